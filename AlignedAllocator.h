@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// std::allocator only honours alignments up to alignof(std::max_align_t) before C++17,
+// this one keeps containers of SIMD/cache-line sized types properly aligned.
+template <typename T, size_t Alignment>
+class AlignedAllocator
+{
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>& /*other*/)
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        // over-allocate so the aligned block plus the original pointer always fit
+        size_t bytes = count * sizeof(T) + Alignment + sizeof(void*);
+        void*  raw   = std::malloc(bytes);
+        if (raw == nullptr)
+            throw std::bad_alloc();
+
+        size_t address = reinterpret_cast<size_t>(raw) + sizeof(void*);
+        address        = (address + Alignment - 1) & ~(Alignment - 1);
+        void** aligned = reinterpret_cast<void**>(address);
+        aligned[-1]    = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+
+    void deallocate(T* pointer, size_t /*count*/)
+    {
+        if (pointer != nullptr)
+            std::free(reinterpret_cast<void**>(pointer)[-1]);
+    }
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+    return true;
+}
+
+template <typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+    return false;
+}
@@ -1,10 +1,15 @@
 #pragma once
 
+#include "ParallelFor.h"
 #include "hitable.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <iostream>
+#include <limits>
 #include <vector>
+#include <Hq/JobManager.h>
 #include <Hq/Math/Utils.h>
-#include <Hq/Rng.h>
 
 bool bboxXCompare(const Hitable* a, const Hitable* b)
 {
@@ -44,106 +49,811 @@ bool bboxZCompare(const Hitable* a, const Hitable* b)
         return false;
 }
 
-class BvhNode : public Hitable
+float bboxSurfaceArea(const hq::math::AABBf& bbox)
+{
+    float dx = bbox.max().x - bbox.min().x;
+    float dy = bbox.max().y - bbox.min().y;
+    float dz = bbox.max().z - bbox.min().z;
+    return 2.f * (dx * dy + dy * dz + dz * dx);
+}
+
+float vectorAxis(const hq::math::Vector3f& v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+enum class BvhSplitMethod
+{
+    Median,  // split at the median along the axis the centroids spread the most on (original builder)
+    Sah      // binned surface area heuristic
+};
+
+enum class BvhTraversalMode
+{
+    Unordered,  // test both children against the full ray interval
+    Ordered     // visit the nearer child first and clip the far one to the closest hit so far
+};
+
+struct BvhBuildOptions
+{
+    BvhSplitMethod   splitMethod   = BvhSplitMethod::Median;
+    BvhTraversalMode traversalMode = BvhTraversalMode::Unordered;
+    // number of centroid bins evaluated per axis by the SAH builder
+    int binCount = 12;
+    // nodes with at most this many primitives may become leaves (SAH builder only)
+    int maxLeafSize = 4;
+    // cost model: relative cost of visiting an inner node vs. intersecting a primitive
+    float traversalCost    = 1.f;
+    float intersectionCost = 1.f;
+    // parallel builder only: subtrees with at most this many primitives are built by a single job
+    size_t parallelThreshold = 4096;
+};
+
+// Traversal counters, kept per thread while tracing and merged into process wide totals with
+// flushLocal(). Only maintained when RAYTRACEY_BVH_STATS is defined.
+struct BvhStats
+{
+    uint64_t rays         = 0;
+    uint64_t nodesVisited = 0;
+
+    static BvhStats& local()
+    {
+        thread_local BvhStats stats;
+        return stats;
+    }
+
+    static void flushLocal()
+    {
+        BvhStats& stats = local();
+        totalRays().fetch_add(stats.rays, std::memory_order_relaxed);
+        totalNodesVisited().fetch_add(stats.nodesVisited, std::memory_order_relaxed);
+        stats = BvhStats();
+    }
+
+    static std::atomic<uint64_t>& totalRays()
+    {
+        static std::atomic<uint64_t> counter(0);
+        return counter;
+    }
+
+    static std::atomic<uint64_t>& totalNodesVisited()
+    {
+        static std::atomic<uint64_t> counter(0);
+        return counter;
+    }
+};
+
+#ifdef RAYTRACEY_BVH_STATS
+#define BVH_STATS_ADD(counter, value) (BvhStats::local().counter += (value))
+#else
+#define BVH_STATS_ADD(counter, value) ((void)0)
+#endif
+
+// primitive reference used by the SAH builder so bounds are only queried once
+struct BvhPrimitiveRef
+{
+    Hitable*           hitable;
+    hq::math::AABBf    bbox;
+    hq::math::Vector3f centroid;
+};
+
+struct BvhSahSplit
+{
+    int   axis = -1;  // -1 when no plane separates the centroids
+    int   bin  = 0;   // primitives in bins below this one go left
+    float cost = std::numeric_limits<float>::max();
+};
+
+// Centroid bins of the SAH builder for all three axes. Binners over disjoint ranges of the
+// same node can be merged, which is what the parallel builder does.
+class BvhSahBinner
 {
 public:
-    BvhNode() {}
-    BvhNode(std::vector<Hitable*>& list, float tMin, float tMax)
+    BvhSahBinner(const hq::math::AABBf& centroidBbox, int binCount)
+        : centroidBbox(centroidBbox)
+        , binCount(std::max(binCount, 2))
+        , bins(static_cast<size_t>(3 * std::max(binCount, 2)))
     {
-        left  = nullptr;
-        right = nullptr;
+    }
 
-        int axis = int(3.f * hq::rand01());
-        if (axis == 0)
+    int binIndex(const BvhPrimitiveRef& ref, int axis) const
+    {
+        float extent = vectorAxis(centroidBbox.max(), axis) - vectorAxis(centroidBbox.min(), axis);
+        int   index  = int(binCount * (vectorAxis(ref.centroid, axis) - vectorAxis(centroidBbox.min(), axis)) / extent);
+        return std::min(index, binCount - 1);
+    }
+
+    void add(const BvhPrimitiveRef* first, const BvhPrimitiveRef* last)
+    {
+        for (int axis = 0; axis < 3; ++axis)
         {
-            std::sort(list.begin(), list.end(), bboxXCompare);
+            if (!splittable(axis))
+                continue;
+
+            for (const BvhPrimitiveRef* ref = first; ref != last; ++ref)
+            {
+                Bin& bin = bins[size_t(axis * binCount + binIndex(*ref, axis))];
+                bin.bbox = bin.count == 0 ? ref->bbox : surroundingBbox(bin.bbox, ref->bbox);
+                ++bin.count;
+            }
         }
-        else if (axis == 1)
+    }
+
+    void merge(const BvhSahBinner& other)
+    {
+        for (size_t i = 0; i < bins.size(); ++i)
         {
-            std::sort(list.begin(), list.end(), bboxYCompare);
+            const Bin& otherBin = other.bins[i];
+            if (otherBin.count == 0)
+                continue;
+
+            bins[i].bbox = bins[i].count == 0 ? otherBin.bbox : surroundingBbox(bins[i].bbox, otherBin.bbox);
+            bins[i].count += otherBin.count;
         }
-        else
+    }
+
+    BvhSahSplit findSplit(const hq::math::AABBf& nodeBbox, const BvhBuildOptions& options) const
+    {
+        using namespace hq::math;
+
+        BvhSahSplit        best;
+        std::vector<float> rightAreas(static_cast<size_t>(binCount));
+        std::vector<int>   rightCounts(static_cast<size_t>(binCount));
+        float              nodeArea = std::max(bboxSurfaceArea(nodeBbox), std::numeric_limits<float>::min());
+        for (int axis = 0; axis < 3; ++axis)
         {
-            std::sort(list.begin(), list.end(), bboxZCompare);
+            if (!splittable(axis))
+                continue;
+
+            const Bin* axisBins = &bins[size_t(axis * binCount)];
+
+            // sweep from the right to get the area and count of everything right of each split plane
+            AABBf rightBbox;
+            int   rightCount = 0;
+            for (int i = binCount - 1; i > 0; --i)
+            {
+                const Bin& bin = axisBins[i];
+                if (bin.count > 0)
+                {
+                    rightBbox = rightCount == 0 ? bin.bbox : surroundingBbox(rightBbox, bin.bbox);
+                    rightCount += bin.count;
+                }
+                rightCounts[size_t(i)] = rightCount;
+                rightAreas[size_t(i)]  = rightCount > 0 ? bboxSurfaceArea(rightBbox) : 0.f;
+            }
+
+            // then sweep from the left, splitting between bin i - 1 and bin i
+            AABBf leftBbox;
+            int   leftCount = 0;
+            for (int i = 1; i < binCount; ++i)
+            {
+                const Bin& bin = axisBins[i - 1];
+                if (bin.count > 0)
+                {
+                    leftBbox = leftCount == 0 ? bin.bbox : surroundingBbox(leftBbox, bin.bbox);
+                    leftCount += bin.count;
+                }
+                if (leftCount == 0 || rightCounts[size_t(i)] == 0)
+                    continue;
+
+                float leftArea  = bboxSurfaceArea(leftBbox);
+                float rightArea = rightAreas[size_t(i)];
+                float cost      = options.traversalCost + options.intersectionCost *
+                                                         (leftArea * leftCount + rightArea * rightCounts[size_t(i)]) /
+                                                         nodeArea;
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin  = i;
+                }
+            }
         }
+        return best;
+    }
 
-        if (list.size() == 1)
+private:
+    struct Bin
+    {
+        hq::math::AABBf bbox;
+        int             count = 0;
+    };
+
+    bool splittable(int axis) const
+    {
+        return vectorAxis(centroidBbox.max(), axis) - vectorAxis(centroidBbox.min(), axis) > 0.f;
+    }
+
+    hq::math::AABBf  centroidBbox;
+    int              binCount;
+    std::vector<Bin> bins;
+};
+
+class BvhNode : public Hitable
+{
+public:
+    BvhNode() {}
+    BvhNode(std::vector<Hitable*>& list, float tMin, float tMax,
+            const BvhBuildOptions& options = BvhBuildOptions())
+    {
+        if (list.empty())
         {
-            left = right = list.front();
+            std::cerr << "Can't build a BVH over no primitives\n";
+            return;
         }
-        else if (list.size() == 2)
+        if (options.splitMethod == BvhSplitMethod::Sah)
         {
-            left  = list.front();
-            right = list.back();
+            std::vector<BvhPrimitiveRef> refs(list.size());
+            makeRefs(list.data(), refs.data(), list.size(), tMin, tMax);
+            buildSah(refs.data(), refs.data() + refs.size(), options);
         }
         else
         {
-            std::vector<Hitable*> subLeft(list.begin(), list.begin() + list.size() / 2);
-            std::vector<Hitable*> subRight(list.begin() + list.size() / 2, list.end());
-            left  = new BvhNode(subLeft, tMin, tMax);
-            right = new BvhNode(subRight, tMin, tMax);
+            buildMedian(list.data(), list.data() + list.size(), tMin, tMax, options);
+        }
+    }
+
+    // Parallel build: the top of the tree is split on the calling thread with the per node
+    // work spread over jobMgr, subtrees below options.parallelThreshold are then built as
+    // independent jobs. Must be called from outside the job manager's jobs.
+    BvhNode(std::vector<Hitable*>& list, float tMin, float tMax, const BvhBuildOptions& options,
+            hq::JobManager& jobMgr)
+    {
+        if (list.empty())
+        {
+            std::cerr << "Can't build a BVH over no primitives\n";
+            return;
         }
-        hq::math::AABBf bboxLeft, bboxRight;
-        if (!left->boundingBox(tMin, tMax, bboxLeft) || !right->boundingBox(tMin, tMax, bboxRight))
+        std::vector<BuildTask> tasks;
+        if (options.splitMethod == BvhSplitMethod::Sah)
         {
-            std::cerr << "No bounding box in BvhNode constructor\n";
+            std::vector<BvhPrimitiveRef> refs(list.size());
+            parallelFor(jobMgr, list.size(), parallelChunkCount(list.size(), 1024),
+                        [&](size_t /*chunk*/, size_t begin, size_t end) {
+                            makeRefs(list.data() + begin, refs.data() + begin, end - begin, tMin, tMax);
+                        });
+            buildSahParallel(refs.data(), refs.data() + refs.size(), options, jobMgr, tasks);
+            runTasks(jobMgr, tasks, tMin, tMax, options);
+        }
+        else
+        {
+            buildMedianParallel(list.data(), list.data() + list.size(), tMin, tMax, options, tasks);
+            runTasks(jobMgr, tasks, tMin, tMax, options);
+            updateInnerBboxes();
         }
-        bbox = surroundingBbox(bboxLeft, bboxRight);
     }
 
     void release()
     {
-        if (dynamic_cast<BvhNode*>(left) != nullptr)
+        if (left != nullptr)
         {
+            left->release();
             delete left;
             left = nullptr;
         }
-        if (dynamic_cast<BvhNode*>(right) != nullptr)
+        if (right != nullptr)
         {
+            right->release();
             delete right;
             right = nullptr;
         }
+        primitives.clear();
+    }
+
+    bool isLeaf() const
+    {
+        return left == nullptr;
+    }
+
+    // levels of the subtree, 1 for a leaf
+    int depth() const
+    {
+        return isLeaf() ? 1 : 1 + std::max(left->depth(), right->depth());
+    }
+
+    // Builds a balanced tree over copies of the leaves of source, which keep their depth first
+    // order. For trees too deep for the fixed traversal stacks of the flattened layouts.
+    void buildBalanced(const BvhNode& source)
+    {
+        std::vector<const BvhNode*> leaves;
+        source.collectLeaves(leaves);
+        buildBalanced(leaves.data(), leaves.data() + leaves.size(), source.traversalMode);
+    }
+
+    // Expected cost of tracing a ray through this subtree under the SAH cost model,
+    // relative to the cost of a single primitive intersection of options.intersectionCost.
+    float sahCost(const BvhBuildOptions& options = BvhBuildOptions()) const
+    {
+        if (isLeaf())
+            return options.intersectionCost * primitives.size();
+
+        float area = std::max(bboxSurfaceArea(bbox), std::numeric_limits<float>::min());
+        return options.traversalCost + (bboxSurfaceArea(left->bbox) * left->sahCost(options) +
+                                        bboxSurfaceArea(right->bbox) * right->sahCost(options)) /
+                                           area;
+    }
+
+    // Recomputes the bounds of the subtree bottom up from the current primitive bounds over
+    // [tMin, tMax], keeping the topology.
+    const hq::math::AABBf& refit(float tMin, float tMax)
+    {
+        if (isLeaf())
+        {
+            for (size_t i = 0; i < primitives.size(); ++i)
+            {
+                hq::math::AABBf primitiveBbox;
+                if (!primitives[i]->boundingBox(tMin, tMax, primitiveBbox))
+                {
+                    std::cerr << "No bounding box in BvhNode::refit\n";
+                }
+                bbox = i == 0 ? primitiveBbox : surroundingBbox(bbox, primitiveBbox);
+            }
+        }
+        else
+        {
+            bbox = surroundingBbox(left->refit(tMin, tMax), right->refit(tMin, tMax));
+        }
+        return bbox;
     }
 
     bool hit(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const override
     {
-        if (bbox.hit(r, tMin, tMax))
+        BVH_STATS_ADD(rays, 1);
+        if (traversalMode == BvhTraversalMode::Ordered)
+            return hitOrdered(r, tMin, tMax, hitData);
+        else
+            return hitUnordered(r, tMin, tMax, hitData);
+    }
+    bool boundingBox(float /*tMin*/, float /*tMax*/, hq::math::AABBf& bbox) const override
+    {
+        bbox = this->bbox;
+        return true;
+    }
+
+private:
+    bool hitLeaf(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const
+    {
+        bool  hitAnything  = false;
+        float closestSofar = tMax;
+        for (const auto* hitable : primitives)
         {
-            HitData leftHitData, rightHitData;
-            bool    hitLeft  = left->hit(r, tMin, tMax, leftHitData);
-            bool    hitRight = right->hit(r, tMin, tMax, rightHitData);
-            if (hitLeft && hitRight)
+            if (hitable->hit(r, tMin, closestSofar, hitData))
             {
-                if (leftHitData.t < rightHitData.t)
-                    hitData = leftHitData;
+                hitAnything  = true;
+                closestSofar = hitData.t;
+            }
+        }
+        return hitAnything;
+    }
+
+    bool hitOrdered(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const
+    {
+        BVH_STATS_ADD(nodesVisited, 1);
+        if (!bbox.hit(r, tMin, tMax))
+            return false;
+
+        if (isLeaf())
+            return hitLeaf(r, tMin, tMax, hitData);
+
+        // children are split along `axis` with the left one on the lower side
+        const BvhNode* nearChild = left;
+        const BvhNode* farChild  = right;
+        if (vectorAxis(r.direction(), axis) < 0.f)
+            std::swap(nearChild, farChild);
+
+        bool hitNear = nearChild->hitOrdered(r, tMin, tMax, hitData);
+        if (hitNear)
+            tMax = hitData.t;
+        bool hitFar = farChild->hitOrdered(r, tMin, tMax, hitData);
+        return hitNear || hitFar;
+    }
+
+    bool hitUnordered(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const
+    {
+        BVH_STATS_ADD(nodesVisited, 1);
+        if (!bbox.hit(r, tMin, tMax))
+            return false;
+
+        if (isLeaf())
+            return hitLeaf(r, tMin, tMax, hitData);
+
+        HitData leftHitData, rightHitData;
+        bool    hitLeft  = left->hitUnordered(r, tMin, tMax, leftHitData);
+        bool    hitRight = right->hitUnordered(r, tMin, tMax, rightHitData);
+        if (hitLeft && hitRight)
+        {
+            if (leftHitData.t < rightHitData.t)
+                hitData = leftHitData;
+            else
+                hitData = rightHitData;
+            return true;
+        }
+        else if (hitLeft)
+        {
+            hitData = leftHitData;
+            return true;
+        }
+        else if (hitRight)
+        {
+            hitData = rightHitData;
+            return true;
+        }
+        else
+            return false;
+    }
+
+
+    void collectLeaves(std::vector<const BvhNode*>& leaves) const
+    {
+        if (isLeaf())
+        {
+            leaves.push_back(this);
+            return;
+        }
+        left->collectLeaves(leaves);
+        right->collectLeaves(leaves);
+    }
+
+    void buildBalanced(const BvhNode* const* first, const BvhNode* const* last, BvhTraversalMode mode)
+    {
+        using namespace hq::math;
+
+        traversalMode = mode;
+        if (last - first == 1)
+        {
+            bbox       = (*first)->bbox;
+            primitives = (*first)->primitives;
+            return;
+        }
+
+        const BvhNode* const* middle = first + (last - first) / 2;
+        left                         = new BvhNode();
+        right                        = new BvhNode();
+        left->buildBalanced(first, middle, mode);
+        right->buildBalanced(middle, last, mode);
+        bbox = surroundingBbox(left->bbox, right->bbox);
+
+        // the ordered traversal expects the left child on the lower side of axis
+        Vector3f offset = (right->bbox.min() + right->bbox.max()) - (left->bbox.min() + left->bbox.max());
+        axis            = offset.x >= offset.y && offset.x >= offset.z ? 0 : (offset.y >= offset.z ? 1 : 2);
+    }
+
+    // subtree left to a job by the parallel builder, only one of the two ranges is set
+    struct BuildTask
+    {
+        BvhNode*         node;
+        Hitable**        firstHitable;
+        Hitable**        lastHitable;
+        BvhPrimitiveRef* firstRef;
+        BvhPrimitiveRef* lastRef;
+    };
+
+    static void makeRefs(Hitable* const* hitables, BvhPrimitiveRef* refs, size_t count, float tMin, float tMax)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            refs[i].hitable = hitables[i];
+            if (!hitables[i]->boundingBox(tMin, tMax, refs[i].bbox))
+            {
+                std::cerr << "No bounding box in BvhNode constructor\n";
+            }
+            refs[i].centroid = 0.5f * (refs[i].bbox.min() + refs[i].bbox.max());
+        }
+    }
+
+    static void runTasks(hq::JobManager& jobMgr, const std::vector<BuildTask>& tasks, float tMin, float tMax,
+                         const BvhBuildOptions& options)
+    {
+        parallelFor(jobMgr, tasks.size(), tasks.size(), [&](size_t /*chunk*/, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const BuildTask& task = tasks[i];
+                if (task.firstRef != nullptr)
+                    task.node->buildSah(task.firstRef, task.lastRef, options);
                 else
-                    hitData = rightHitData;
-                return true;
+                    task.node->buildMedian(task.firstHitable, task.lastHitable, tMin, tMax, options);
             }
-            else if (hitLeft)
+        });
+    }
+
+    void makeLeaf(Hitable** first, Hitable** last, float tMin, float tMax)
+    {
+        primitives.assign(first, last);
+        if (!primitives.front()->boundingBox(tMin, tMax, bbox))
+        {
+            std::cerr << "No bounding box in BvhNode constructor\n";
+        }
+        for (const auto* hitable : primitives)
+        {
+            hq::math::AABBf primitiveBbox;
+            if (!hitable->boundingBox(tMin, tMax, primitiveBbox))
             {
-                hitData = leftHitData;
-                return true;
+                std::cerr << "No bounding box in BvhNode constructor\n";
             }
-            else if (hitRight)
+            bbox = surroundingBbox(bbox, primitiveBbox);
+        }
+    }
+
+    // Partitions [first, last) around the median along the axis of largest centroid extent.
+    // Returns the median or nullptr once the range is small enough to become a leaf.
+    Hitable** splitMedian(Hitable** first, Hitable** last, const BvhBuildOptions& options)
+    {
+        using namespace hq::math;
+
+        size_t count  = size_t(last - first);
+        traversalMode = options.traversalMode;
+        if (count <= 2)
+            return nullptr;
+
+        // only depends on the range, so the tree is the same whichever thread builds it
+        AABBf centroidBbox;
+        for (Hitable** hitable = first; hitable != last; ++hitable)
+        {
+            AABBf primitiveBbox;
+            if (!(*hitable)->boundingBox(0.f, 0.f, primitiveBbox))
             {
-                hitData = rightHitData;
-                return true;
+                std::cerr << "No bounding box in BvhNode constructor\n";
             }
-            else
-                return false;
+            Vector3f centroid = 0.5f * (primitiveBbox.min() + primitiveBbox.max());
+            AABBf    centroidPoint(centroid, centroid);
+            centroidBbox = hitable == first ? centroidPoint : surroundingBbox(centroidBbox, centroidPoint);
+        }
+        Vector3f extent = centroidBbox.max() - centroidBbox.min();
+        axis            = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+        // only the two halves matter, their order is decided further down the tree
+        Hitable** middle = first + count / 2;
+        if (axis == 0)
+        {
+            std::nth_element(first, middle, last, bboxXCompare);
+        }
+        else if (axis == 1)
+        {
+            std::nth_element(first, middle, last, bboxYCompare);
         }
         else
-            return false;
+        {
+            std::nth_element(first, middle, last, bboxZCompare);
+        }
+        return middle;
     }
-    bool boundingBox(float /*tMin*/, float /*tMax*/, hq::math::AABBf& bbox) const override
+
+    void buildMedian(Hitable** first, Hitable** last, float tMin, float tMax, const BvhBuildOptions& options)
     {
-        bbox = this->bbox;
-        return true;
+        Hitable** middle = splitMedian(first, last, options);
+        if (middle == nullptr)
+        {
+            makeLeaf(first, last, tMin, tMax);
+            return;
+        }
+
+        left  = new BvhNode();
+        right = new BvhNode();
+        left->buildMedian(first, middle, tMin, tMax, options);
+        right->buildMedian(middle, last, tMin, tMax, options);
+        bbox = surroundingBbox(left->bbox, right->bbox);
+    }
+
+    void buildMedianParallel(Hitable** first, Hitable** last, float tMin, float tMax, const BvhBuildOptions& options,
+                             std::vector<BuildTask>& tasks)
+    {
+        if (size_t(last - first) <= std::max<size_t>(options.parallelThreshold, 2))
+        {
+            tasks.push_back({this, first, last, nullptr, nullptr});
+            return;
+        }
+
+        Hitable** middle = splitMedian(first, last, options);
+        left             = new BvhNode();
+        right            = new BvhNode();
+        left->buildMedianParallel(first, middle, tMin, tMax, options, tasks);
+        right->buildMedianParallel(middle, last, tMin, tMax, options, tasks);
+    }
+
+    // the inner nodes above the parallel median builder's tasks only get their bounds once
+    // the tasks are done
+    const hq::math::AABBf& updateInnerBboxes()
+    {
+        if (!isLeaf())
+            bbox = surroundingBbox(left->updateInnerBboxes(), right->updateInnerBboxes());
+        return bbox;
+    }
+
+    static bool sahLeaf(size_t count, const BvhSahSplit& split, const BvhBuildOptions& options)
+    {
+        if (count == 1)
+            return true;
+
+        float leafCost = options.intersectionCost * count;
+        return int(count) <= options.maxLeafSize && (split.axis < 0 || leafCost <= split.cost);
+    }
+
+    void buildSah(BvhPrimitiveRef* first, BvhPrimitiveRef* last, const BvhBuildOptions& options)
+    {
+        using namespace hq::math;
+
+        size_t count  = size_t(last - first);
+        traversalMode = options.traversalMode;
+        AABBf centroidBbox(first->centroid, first->centroid);
+        bbox = first->bbox;
+        for (BvhPrimitiveRef* ref = first; ref != last; ++ref)
+        {
+            bbox         = surroundingBbox(bbox, ref->bbox);
+            centroidBbox = surroundingBbox(centroidBbox, AABBf(ref->centroid, ref->centroid));
+        }
+
+        BvhSahBinner binner(centroidBbox, options.binCount);
+        BvhSahSplit  split;
+        if (count > 1)
+        {
+            binner.add(first, last);
+            split = binner.findSplit(bbox, options);
+        }
+        if (sahLeaf(count, split, options))
+        {
+            makeSahLeaf(first, last);
+            return;
+        }
+
+        BvhPrimitiveRef* middle;
+        if (split.axis < 0)
+        {
+            // all centroids coincide, no plane separates them: split the range in half
+            middle = first + count / 2;
+        }
+        else
+        {
+            axis   = split.axis;
+            middle = std::partition(first, last, [&](const BvhPrimitiveRef& ref) {
+                return binner.binIndex(ref, split.axis) < split.bin;
+            });
+        }
+
+        left  = new BvhNode();
+        right = new BvhNode();
+        left->buildSah(first, middle, options);
+        right->buildSah(middle, last, options);
+    }
+
+    // Same as buildSah() but the bounds, binning and partitioning of the node are spread over
+    // the job manager, subtrees under options.parallelThreshold are queued in tasks.
+    void buildSahParallel(BvhPrimitiveRef* first, BvhPrimitiveRef* last, const BvhBuildOptions& options,
+                          hq::JobManager& jobMgr, std::vector<BuildTask>& tasks)
+    {
+        using namespace hq::math;
+
+        size_t count = size_t(last - first);
+        if (count <= std::max<size_t>(options.parallelThreshold, size_t(std::max(options.maxLeafSize, 1))))
+        {
+            tasks.push_back({this, nullptr, nullptr, first, last});
+            return;
+        }
+
+        traversalMode     = options.traversalMode;
+        size_t chunkCount = parallelChunkCount(count, 1024);
+
+        std::vector<AABBf> chunkBboxes(chunkCount);
+        std::vector<AABBf> chunkCentroidBboxes(chunkCount);
+        parallelFor(jobMgr, count, chunkCount, [&](size_t chunk, size_t begin, size_t end) {
+            AABBf chunkBbox = first[begin].bbox;
+            AABBf chunkCentroidBbox(first[begin].centroid, first[begin].centroid);
+            for (size_t i = begin; i < end; ++i)
+            {
+                chunkBbox         = surroundingBbox(chunkBbox, first[i].bbox);
+                chunkCentroidBbox = surroundingBbox(chunkCentroidBbox, AABBf(first[i].centroid, first[i].centroid));
+            }
+            chunkBboxes[chunk]         = chunkBbox;
+            chunkCentroidBboxes[chunk] = chunkCentroidBbox;
+        });
+        bbox               = chunkBboxes.front();
+        AABBf centroidBbox = chunkCentroidBboxes.front();
+        for (size_t chunk = 1; chunk < chunkCount; ++chunk)
+        {
+            bbox         = surroundingBbox(bbox, chunkBboxes[chunk]);
+            centroidBbox = surroundingBbox(centroidBbox, chunkCentroidBboxes[chunk]);
+        }
+
+        std::vector<BvhSahBinner> chunkBinners(chunkCount, BvhSahBinner(centroidBbox, options.binCount));
+        parallelFor(jobMgr, count, chunkCount, [&](size_t chunk, size_t begin, size_t end) {
+            chunkBinners[chunk].add(first + begin, first + end);
+        });
+        BvhSahBinner& binner = chunkBinners.front();
+        for (size_t chunk = 1; chunk < chunkCount; ++chunk)
+        {
+            binner.merge(chunkBinners[chunk]);
+        }
+
+        BvhSahSplit      split = binner.findSplit(bbox, options);
+        BvhPrimitiveRef* middle;
+        if (split.axis < 0)
+        {
+            middle = first + count / 2;
+        }
+        else
+        {
+            axis   = split.axis;
+            middle = parallelPartition(jobMgr, first, last, chunkCount, [&](const BvhPrimitiveRef& ref) {
+                return binner.binIndex(ref, split.axis) < split.bin;
+            });
+        }
+
+        left  = new BvhNode();
+        right = new BvhNode();
+        left->buildSahParallel(first, middle, options, jobMgr, tasks);
+        right->buildSahParallel(middle, last, options, jobMgr, tasks);
+    }
+
+    // Stable partition through a scratch buffer: every chunk counts its primitives going left,
+    // the prefix sums of those counts give each chunk its output ranges.
+    template <typename Predicate>
+    static BvhPrimitiveRef* parallelPartition(hq::JobManager& jobMgr, BvhPrimitiveRef* first, BvhPrimitiveRef* last,
+                                              size_t chunkCount, Predicate predicate)
+    {
+        size_t count = size_t(last - first);
+        chunkCount   = std::max<size_t>(std::min(chunkCount, count), 1);
+
+        std::vector<size_t> leftCounts(chunkCount);
+        parallelFor(jobMgr, count, chunkCount, [&](size_t chunk, size_t begin, size_t end) {
+            size_t leftCount = 0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                if (predicate(first[i]))
+                    ++leftCount;
+            }
+            leftCounts[chunk] = leftCount;
+        });
+
+        size_t totalLeft = 0;
+        for (size_t leftCount : leftCounts)
+        {
+            totalLeft += leftCount;
+        }
+        std::vector<size_t> leftOffsets(chunkCount);
+        std::vector<size_t> rightOffsets(chunkCount);
+        size_t              leftOffset  = 0;
+        size_t              rightOffset = totalLeft;
+        for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+        {
+            size_t chunkSize    = count * (chunk + 1) / chunkCount - count * chunk / chunkCount;
+            leftOffsets[chunk]  = leftOffset;
+            rightOffsets[chunk] = rightOffset;
+            leftOffset += leftCounts[chunk];
+            rightOffset += chunkSize - leftCounts[chunk];
+        }
+
+        std::vector<BvhPrimitiveRef> scratch(count);
+        parallelFor(jobMgr, count, chunkCount, [&](size_t chunk, size_t begin, size_t end) {
+            size_t leftIndex  = leftOffsets[chunk];
+            size_t rightIndex = rightOffsets[chunk];
+            for (size_t i = begin; i < end; ++i)
+            {
+                if (predicate(first[i]))
+                    scratch[leftIndex++] = first[i];
+                else
+                    scratch[rightIndex++] = first[i];
+            }
+        });
+        parallelFor(jobMgr, count, chunkCount, [&](size_t /*chunk*/, size_t begin, size_t end) {
+            std::copy(scratch.begin() + begin, scratch.begin() + end, first + begin);
+        });
+
+        return first + totalLeft;
+    }
+
+    void makeSahLeaf(BvhPrimitiveRef* first, BvhPrimitiveRef* last)
+    {
+        primitives.reserve(size_t(last - first));
+        for (BvhPrimitiveRef* ref = first; ref != last; ++ref)
+        {
+            primitives.push_back(ref->hitable);
+        }
     }
 
 public:
-    Hitable*        left;
-    Hitable*        right;
-    hq::math::AABBf bbox;
+    BvhNode*              left  = nullptr;
+    BvhNode*              right = nullptr;
+    hq::math::AABBf       bbox;
+    std::vector<Hitable*> primitives;  // only set on leaves
+    int                   axis          = 0;  // split axis of inner nodes
+    BvhTraversalMode      traversalMode = BvhTraversalMode::Unordered;
 };
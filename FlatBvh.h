@@ -0,0 +1,303 @@
+#pragma once
+
+#include "AlignedAllocator.h"
+#include "BvhNode.h"
+#include "hitable.h"
+#include <assert.h>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <Hq/Math/Utils.h>
+
+// 32 byte node, two of them share a cache line. Nodes are stored in depth first order so
+// the first child of an inner node always directly follows its parent.
+struct alignas(32) FlatBvhNode
+{
+    float    bboxMin[3];
+    uint32_t offset;  // inner node: index of the second child, leaf: index of the first primitive
+    float    bboxMax[3];
+    uint16_t primitiveCount;  // 0 for inner nodes
+    uint8_t  axis;            // split axis of inner nodes
+    uint8_t  pad;
+
+    bool isLeaf() const
+    {
+        return primitiveCount > 0;
+    }
+
+    void setBbox(const hq::math::AABBf& bbox)
+    {
+        bboxMin[0] = bbox.min().x;
+        bboxMin[1] = bbox.min().y;
+        bboxMin[2] = bbox.min().z;
+        bboxMax[0] = bbox.max().x;
+        bboxMax[1] = bbox.max().y;
+        bboxMax[2] = bbox.max().z;
+    }
+
+    hq::math::AABBf bbox() const
+    {
+        using hq::math::Vector3f;
+        return hq::math::AABBf(Vector3f(bboxMin[0], bboxMin[1], bboxMin[2]),
+                               Vector3f(bboxMax[0], bboxMax[1], bboxMax[2]));
+    }
+
+    bool hit(const float origin[3], const float invDirection[3], float tMin, float tMax) const
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t0 = (bboxMin[axis] - origin[axis]) * invDirection[axis];
+            float t1 = (bboxMax[axis] - origin[axis]) * invDirection[axis];
+            if (invDirection[axis] < 0.f)
+                std::swap(t0, t1);
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+            if (tMax <= tMin)
+                return false;
+        }
+        return true;
+    }
+};
+
+static_assert(sizeof(FlatBvhNode) == 32, "FlatBvhNode is expected to be 32 bytes");
+
+// Compact, pointer free BVH. Primitive ranges of the leaves index into `primitives`, which
+// is reordered so every leaf references a contiguous run.
+class FlatBvh : public Hitable
+{
+public:
+    FlatBvh() {}
+    explicit FlatBvh(const BvhNode& root)
+    {
+        flatten(root);
+    }
+    FlatBvh(std::vector<Hitable*>& list, float tMin, float tMax, const BvhBuildOptions& options = BvhBuildOptions())
+    {
+        BvhNode root(list, tMin, tMax, options);
+        flatten(root);
+        root.release();
+    }
+
+    void flatten(const BvhNode& root)
+    {
+        nodes.clear();
+        primitives.clear();
+        traversalMode = root.traversalMode;
+        depth         = 0;
+        flattenNode(root, 1);
+
+        // the traversal pushes at most one node per level, deeper trees such as the SAH
+        // builder's chains over clustered primitives would overflow its stack
+        if (depth > StackSize)
+        {
+            std::cerr << "BVH with " << depth << " levels is too deep to traverse, rebalancing it\n";
+            BvhNode balanced;
+            balanced.buildBalanced(root);
+            flatten(balanced);
+            balanced.release();
+            return;
+        }
+        referenceSahCost = sahCost();
+    }
+
+    // Recomputes all bounds bottom up from the current primitive bounds over [tMin, tMax]
+    // without touching the topology, e.g. after spheres moved between frames.
+    void refit(float tMin, float tMax)
+    {
+        // children are always stored after their parent, a reverse sweep visits them first
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            FlatBvhNode&    node = nodes[i];
+            hq::math::AABBf bbox;
+            if (node.isLeaf())
+            {
+                bool empty = true;
+                for (uint32_t j = node.offset; j < node.offset + node.primitiveCount; ++j)
+                {
+                    // SphereBvh pads its leaves with empty slots
+                    if (primitives[j] == nullptr)
+                        continue;
+
+                    hq::math::AABBf primitiveBbox;
+                    if (!primitives[j]->boundingBox(tMin, tMax, primitiveBbox))
+                    {
+                        std::cerr << "No bounding box in FlatBvh::refit\n";
+                    }
+                    bbox  = empty ? primitiveBbox : surroundingBbox(bbox, primitiveBbox);
+                    empty = false;
+                }
+            }
+            else
+            {
+                bbox = surroundingBbox(nodes[i + 1].bbox(), nodes[node.offset].bbox());
+            }
+            node.setBbox(bbox);
+        }
+    }
+
+    // Refits, then rebuilds from scratch with options when the SAH cost grew by more than
+    // maxSahDegradation (0.25 = 25%) over the cost the tree had when it was built. A negative
+    // maxSahDegradation skips the check. Returns true when the tree was rebuilt.
+    bool refitOrRebuild(float tMin, float tMax, const BvhBuildOptions& options, float maxSahDegradation = 0.25f)
+    {
+        refit(tMin, tMax);
+        if (!sahDegraded(maxSahDegradation))
+            return false;
+
+        std::vector<Hitable*> list = primitives;
+        BvhNode               root(list, tMin, tMax, options);
+        flatten(root);
+        root.release();
+        return true;
+    }
+
+    // true when the SAH cost grew by more than maxSahDegradation since the tree was built, never
+    // for a negative maxSahDegradation
+    bool sahDegraded(float maxSahDegradation) const
+    {
+        return maxSahDegradation >= 0.f && sahCost() > referenceSahCost * (1.f + maxSahDegradation);
+    }
+
+    // Same cost model as BvhNode::sahCost()
+    float sahCost(const BvhBuildOptions& options = BvhBuildOptions()) const
+    {
+        std::vector<float> costs(nodes.size());
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            const FlatBvhNode& node = nodes[i];
+            if (node.isLeaf())
+            {
+                costs[i] = options.intersectionCost * node.primitiveCount;
+                continue;
+            }
+
+            float area = std::max(bboxSurfaceArea(node.bbox()), std::numeric_limits<float>::min());
+            costs[i]   = options.traversalCost + (bboxSurfaceArea(nodes[i + 1].bbox()) * costs[i + 1] +
+                                                bboxSurfaceArea(nodes[node.offset].bbox()) * costs[node.offset]) /
+                                                   area;
+        }
+        return costs.empty() ? 0.f : costs.front();
+    }
+
+    bool hit(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const override
+    {
+        uint32_t primitiveIndex = 0;
+        auto intersectLeaf = [this, &r](const FlatBvhNode& leaf, float rayTMin, float& closest, uint32_t& hitIndex) {
+            bool hitAnything = false;
+            for (uint32_t i = leaf.offset; i < leaf.offset + leaf.primitiveCount; ++i)
+            {
+                if (primitives[i]->intersect(r, rayTMin, closest, closest))
+                {
+                    hitAnything = true;
+                    hitIndex    = i;
+                }
+            }
+            return hitAnything;
+        };
+
+        if (!traverse(r, tMin, tMax, primitiveIndex, intersectLeaf))
+            return false;
+
+        primitives[primitiveIndex]->fillHitData(r, tMax, hitData);
+        return true;
+    }
+
+    // Iterative traversal kernel. Only the closest distance (in tMax) and the index of the leaf
+    // item that produced it are tracked; intersectLeaf(leaf, tMin, tMax, index) tests the items of
+    // a leaf and shrinks tMax/sets index on a closer hit.
+    template <typename LeafIntersector>
+    bool traverse(const hq::math::Rayf& r, float tMin, float& tMax, uint32_t& hitIndex,
+                  LeafIntersector&& intersectLeaf) const
+    {
+        if (nodes.empty())
+            return false;
+
+        const hq::math::Vector3f& origin    = r.origin();
+        const hq::math::Vector3f& direction = r.direction();
+        float                     o[3]      = {origin.x, origin.y, origin.z};
+        float invDirection[3] = {1.f / direction.x, 1.f / direction.y, 1.f / direction.z};
+        bool  ordered         = traversalMode == BvhTraversalMode::Ordered;
+
+        BVH_STATS_ADD(rays, 1);
+        uint32_t stack[StackSize];
+        int      stackSize   = 0;
+        uint32_t index       = 0;
+        bool     hitAnything = false;
+        for (;;)
+        {
+            BVH_STATS_ADD(nodesVisited, 1);
+            const FlatBvhNode& node = nodes[index];
+            if (node.hit(o, invDirection, tMin, tMax))
+            {
+                if (!node.isLeaf())
+                {
+                    // the first child is stored right after its parent and lies on the lower side of the split
+                    uint32_t nearChild = index + 1;
+                    uint32_t farChild  = node.offset;
+                    if (ordered && invDirection[node.axis] < 0.f)
+                        std::swap(nearChild, farChild);
+
+                    // flatten() keeps the depth within the stack
+                    assert(stackSize < StackSize);
+                    stack[stackSize++] = farChild;
+                    index              = nearChild;
+                    continue;
+                }
+
+                if (intersectLeaf(node, tMin, tMax, hitIndex))
+                    hitAnything = true;
+            }
+
+            if (stackSize == 0)
+                break;
+            index = stack[--stackSize];
+        }
+
+        return hitAnything;
+    }
+
+    bool boundingBox(float /*tMin*/, float /*tMax*/, hq::math::AABBf& bbox) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        bbox = nodes.front().bbox();
+        return true;
+    }
+
+public:
+    // deep enough for the linear builder, whose trees can use one level per Morton code bit,
+    // flatten() rebalances deeper trees
+    static const int StackSize = 128;
+
+    std::vector<FlatBvhNode, AlignedAllocator<FlatBvhNode, 32> > nodes;
+    std::vector<Hitable*>                                        primitives;
+    BvhTraversalMode                                             traversalMode = BvhTraversalMode::Unordered;
+    float                                                        referenceSahCost = 0.f;  // sahCost() when built
+    int                                                          depth            = 0;    // levels, at most StackSize
+
+private:
+    uint32_t flattenNode(const BvhNode& node, int level)
+    {
+        depth          = std::max(depth, level);
+        uint32_t index = uint32_t(nodes.size());
+        nodes.emplace_back();
+        nodes[index].setBbox(node.bbox);
+        nodes[index].axis = uint8_t(node.axis);
+        nodes[index].pad  = 0;
+        if (node.isLeaf())
+        {
+            nodes[index].offset         = uint32_t(primitives.size());
+            nodes[index].primitiveCount = uint16_t(node.primitives.size());
+            primitives.insert(primitives.end(), node.primitives.begin(), node.primitives.end());
+        }
+        else
+        {
+            nodes[index].primitiveCount = 0;
+            flattenNode(*node.left, level + 1);
+            uint32_t secondChild = flattenNode(*node.right, level + 1);
+            nodes[index].offset  = secondChild;
+        }
+        return index;
+    }
+};
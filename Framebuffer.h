@@ -0,0 +1,106 @@
+#pragma once
+
+#include "AlignedAllocator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <Hq/Math/Vector.h>
+
+// Float RGB radiance accumulated over any number of passes, with a running (Welford) estimate
+// of the luminance variance of every pixel for adaptive sampling. Pixels are only ever written
+// by the worker rendering their tile, so no synchronization is needed within a pass.
+class Framebuffer
+{
+public:
+    Framebuffer(uint32_t width, uint32_t height)
+        : width(width)
+        , height(height)
+        , accumulation(size_t(width) * height * 3)
+        , samples(size_t(width) * height)
+        , luminanceMean(size_t(width) * height)
+        , luminanceM2(size_t(width) * height)
+    {
+    }
+
+    void clear()
+    {
+        std::fill(accumulation.begin(), accumulation.end(), 0.f);
+        std::fill(samples.begin(), samples.end(), 0u);
+        std::fill(luminanceMean.begin(), luminanceMean.end(), 0.f);
+        std::fill(luminanceM2.begin(), luminanceM2.end(), 0.f);
+    }
+
+    // adds one radiance sample to pixel (x, y)
+    void addSample(uint32_t x, uint32_t y, const hq::math::Vector3f& radiance)
+    {
+        size_t index = size_t(y) * width + x;
+        accumulation[3 * index + 0] += radiance.r;
+        accumulation[3 * index + 1] += radiance.g;
+        accumulation[3 * index + 2] += radiance.b;
+        samples[index] += 1;
+
+        float luminance = 0.2126f * radiance.r + 0.7152f * radiance.g + 0.0722f * radiance.b;
+        float delta     = luminance - luminanceMean[index];
+        luminanceMean[index] += delta / float(samples[index]);
+        luminanceM2[index] += delta * (luminance - luminanceMean[index]);
+    }
+
+    // running average of pixel (x, y), black before its first sample
+    hq::math::Vector3f average(uint32_t x, uint32_t y) const
+    {
+        size_t index = size_t(y) * width + x;
+        if (samples[index] == 0)
+            return hq::math::Vector3f(0.f, 0.f, 0.f);
+
+        float scale = 1.f / float(samples[index]);
+        return hq::math::Vector3f(accumulation[3 * index + 0] * scale, accumulation[3 * index + 1] * scale,
+                                  accumulation[3 * index + 2] * scale);
+    }
+
+    uint32_t sampleCount(uint32_t x, uint32_t y) const
+    {
+        return samples[size_t(y) * width + x];
+    }
+
+    // Standard error of the mean luminance of pixel (x, y) relative to that mean. The mean is
+    // floored to a dark but visible level so black pixels don't divide by zero.
+    float relativeError(uint32_t x, uint32_t y) const
+    {
+        size_t index = size_t(y) * width + x;
+        if (samples[index] < 2)
+            return std::numeric_limits<float>::max();
+
+        float n        = float(samples[index]);
+        float variance = luminanceM2[index] / (n - 1.f);
+        return std::sqrt(variance / n) / std::max(luminanceMean[index], 1e-3f);
+    }
+
+public:
+    uint32_t                                         width;
+    uint32_t                                         height;
+    std::vector<float, AlignedAllocator<float, 32> > accumulation;   // interleaved RGB sums
+    std::vector<uint32_t>                            samples;        // samples per pixel
+    std::vector<float>                               luminanceMean;  // Welford running mean
+    std::vector<float>                               luminanceM2;    // Welford sum of squared deviations
+};
+
+// Stops sampling pixels whose relative error dropped under maxRelativeError, so the samples go
+// to the noisy ones (glass, caustics) instead of flat or empty regions.
+struct AdaptiveSampling
+{
+    float    maxRelativeError = 0.02f;  // 0 disables adaptivity, every pixel gets maxSamples
+    uint32_t minSamples       = 32;     // before the variance estimate is trusted
+    uint32_t maxSamples       = 2000;
+
+    bool needsSamples(const Framebuffer& framebuffer, uint32_t x, uint32_t y) const
+    {
+        uint32_t count = framebuffer.sampleCount(x, y);
+        if (count >= maxSamples)
+            return false;
+        if (maxRelativeError <= 0.f || count < minSamples)
+            return true;
+        return framebuffer.relativeError(x, y) > maxRelativeError;
+    }
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "Framebuffer.h"
+#include "Resolve.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// the including translation unit defines STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// Linear RGB averages copied out of a framebuffer, so they can be written to disk while the
+// render goes on
+struct Image
+{
+    // black
+    Image(uint32_t width, uint32_t height)
+        : width(width)
+        , height(height)
+        , pixels(size_t(width) * height * 3)
+    {
+    }
+
+    explicit Image(const Framebuffer& framebuffer)
+        : Image(framebuffer.width, framebuffer.height)
+    {
+        copyFrom(framebuffer, 0, 0, width, height);
+    }
+
+    // copies the current averages of the pixels [x0, x1) x [y0, y1) of framebuffer
+    void copyFrom(const Framebuffer& framebuffer, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+    {
+        for (uint32_t y = y0; y < y1; ++y)
+        {
+            for (uint32_t x = x0; x < x1; ++x)
+            {
+                hq::math::Vector3f average = framebuffer.average(x, y);
+                float*             pixel   = &pixels[3 * (size_t(y) * width + x)];
+                pixel[0]                   = average.r;
+                pixel[1]                   = average.g;
+                pixel[2]                   = average.b;
+            }
+        }
+    }
+
+    // 8 bit display values of row y, interleaved RGB
+    void displayRow(uint32_t y, uint8_t* row) const
+    {
+        const float* pixel = &pixels[3 * size_t(y) * width];
+        for (size_t i = 0; i < size_t(width) * 3; ++i)
+        {
+            row[i] = toDisplayByte(pixel[i]);
+        }
+    }
+
+    uint32_t           width;
+    uint32_t           height;
+    std::vector<float> pixels;  // interleaved RGB, top row first
+};
+
+bool checkWritten(std::ofstream& file, const std::string& path)
+{
+    if (!file)
+    {
+        std::cerr << "Could not write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool openForWriting(std::ofstream& file, const std::string& path)
+{
+    file.open(path, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Could not open " << path << " for writing\n";
+        return false;
+    }
+    return true;
+}
+
+// Writes the display values of image as a binary PPM (P6)
+bool writePpm(const std::string& path, const Image& image)
+{
+    std::ofstream file;
+    if (!openForWriting(file, path))
+        return false;
+
+    file << "P6\n" << image.width << " " << image.height << "\n255\n";
+    std::vector<uint8_t> row(size_t(image.width) * 3);
+    for (uint32_t y = 0; y < image.height; ++y)
+    {
+        image.displayRow(y, row.data());
+        file.write(reinterpret_cast<const char*>(row.data()), std::streamsize(row.size()));
+    }
+    return checkWritten(file, path);
+}
+
+// Writes the linear values of image as a little endian PFM, no clamping or gamma, for
+// compositing and denoising
+bool writePfm(const std::string& path, const Image& image)
+{
+    std::ofstream file;
+    if (!openForWriting(file, path))
+        return false;
+
+    // a negative scale marks little endian data, the only byte order this is built for
+    file << "PF\n" << image.width << " " << image.height << "\n-1.0\n";
+    // rows go bottom to top
+    for (uint32_t y = image.height; y-- > 0;)
+    {
+        file.write(reinterpret_cast<const char*>(&image.pixels[3 * size_t(y) * image.width]),
+                   std::streamsize(sizeof(float) * 3 * image.width));
+    }
+    return checkWritten(file, path);
+}
+
+// Writes the display values of image as an 8 bit RGB PNG
+bool writePng(const std::string& path, const Image& image)
+{
+    size_t               rowSize = size_t(image.width) * 3;
+    std::vector<uint8_t> pixels(rowSize * image.height);
+    for (uint32_t y = 0; y < image.height; ++y)
+    {
+        image.displayRow(y, &pixels[rowSize * y]);
+    }
+    if (stbi_write_png(path.c_str(), int(image.width), int(image.height), 3, pixels.data(), int(rowSize)) == 0)
+    {
+        std::cerr << "Could not write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Writes image in the format given by the extension of path: .ppm, .png or .pfm (linear HDR)
+bool writeImage(const std::string& path, const Image& image)
+{
+    size_t      dot       = path.find_last_of('.');
+    std::string extension = dot == std::string::npos ? std::string() : path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](char c) { return char(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c); });
+    if (extension == "ppm")
+        return writePpm(path, image);
+    if (extension == "png")
+        return writePng(path, image);
+    if (extension == "pfm")
+        return writePfm(path, image);
+
+    std::cerr << "Unknown image format of " << path << ", use .ppm, .png or .pfm\n";
+    return false;
+}
+
+// Writes image on a background thread, so rendering doesn't wait for the encoding and the disk.
+// Several writes can share the image. The result tells if writing worked.
+std::future<bool> writeImageAsync(const std::string& path, std::shared_ptr<const Image> image)
+{
+    return std::async(std::launch::async, [path, image]() { return writeImage(path, *image); });
+}
+
+// Copies the current averages out of framebuffer, which no worker may be writing, and writes them
+// on a background thread
+std::future<bool> writeImageAsync(const std::string& path, const Framebuffer& framebuffer)
+{
+    return writeImageAsync(path, std::make_shared<const Image>(framebuffer));
+}
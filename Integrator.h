@@ -0,0 +1,336 @@
+#pragma once
+
+#include "Sampler.h"
+#include "Sampling.h"
+#include "camera.h"
+#include "hitable.h"
+#include "material.h"
+#include "sphere.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <Hq/Math/Ray.h>
+#include <Hq/Math/Vector.h>
+
+// Power heuristic (beta = 2) weight of a sample from the strategy with density pdf against
+// the other one with otherPdf
+float powerHeuristic(float pdf, float otherPdf)
+{
+    float pdf2 = pdf * pdf;
+    float sum  = pdf2 + otherPdf * otherPdf;
+    return sum > 0.f ? pdf2 / sum : 0.f;
+}
+
+// Emissive sphere sampled uniformly over the cone of directions it subtends, which is much
+// less noisy than sampling its surface when it's small or far away. A ray hitting it finds its
+// index in the lights in HitData::light.
+struct SphereLight
+{
+    const Sphere* sphere;
+
+    // 1 - cos of the half angle of the cone seen from p, false when p is inside the sphere
+    bool coneOneMinusCos(const hq::math::Vector3f& p, float time, float& oneMinusCos) const
+    {
+        hq::math::Vector3f toCenter = sphere->getCenter(time) - p;
+        float              sin2     = sphere->radius * sphere->radius / dot(toCenter, toCenter);
+        if (!(sin2 < 1.f))
+            return false;
+
+        // cos = sqrt(1 - sin2) cancels badly for tiny cones, use its series there
+        oneMinusCos = sin2 < 1e-4f ? 0.5f * sin2 : 1.f - std::sqrt(1.f - sin2);
+        return true;
+    }
+
+    // Picks a direction towards the light from p for the random numbers u1, u2 in [0, 1)
+    bool sample(const hq::math::Vector3f& p, float time, float u1, float u2, hq::math::Vector3f& direction,
+                float& pdf) const
+    {
+        using namespace hq::math;
+
+        float oneMinusCos;
+        if (!coneOneMinusCos(p, time, oneMinusCos))
+            return false;
+
+        Onb   basis(normalize(sphere->getCenter(time) - p));
+        float cosTheta = 1.f - u1 * oneMinusCos;
+        float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+        float phi      = 2.f * float(M_PI) * u2;
+        direction      = basis.toWorld(Vector3f(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta));
+        pdf            = 1.f / (2.f * float(M_PI) * oneMinusCos);
+        return true;
+    }
+
+    // solid angle density of sample() for a direction that hits the light
+    float pdf(const hq::math::Vector3f& p, float time) const
+    {
+        float oneMinusCos;
+        if (!coneOneMinusCos(p, time, oneMinusCos))
+            return 0.f;
+        return 1.f / (2.f * float(M_PI) * oneMinusCos);
+    }
+};
+
+// Spheres of list with a material that emits anything, each told its index in the result.
+// Call before building the BVH, which copies the spheres' light indices.
+std::vector<SphereLight> collectSphereLights(const std::vector<Hitable*>& list, const MaterialTable& materials)
+{
+    std::vector<SphereLight> lights;
+    for (Hitable* hitable : list)
+    {
+        Sphere* sphere = dynamic_cast<Sphere*>(hitable);
+        if (sphere == nullptr)
+            continue;
+
+        hq::math::Vector3f emission = materials.emitted(sphere->material, 0.5f, 0.5f, sphere->center, 0.f);
+        if (emission.r <= 0.f && emission.g <= 0.f && emission.b <= 0.f)
+        {
+            sphere->light = NoLight;
+            continue;
+        }
+        sphere->light = uint32_t(lights.size());
+        lights.push_back(SphereLight{sphere});
+    }
+    return lights;
+}
+
+// Camera ray through a jittered point of pixel (x, y) of a width x height image, for the sample
+// sampler was started on
+hq::math::Rayf primaryRay(const Camera& camera, Sampler& sampler, uint32_t x, uint32_t y, uint32_t width,
+                          uint32_t height)
+{
+    hq::math::Vector2f pixelSample = sampler.get2D();
+    hq::math::Vector2f lensSample  = sampler.get2D();
+    float              timeSample  = sampler.get1D();
+    float              u           = (float(x) + pixelSample.u) / float(width);
+    float              v           = (float(height - y - 1) + pixelSample.v) / float(height);
+    return camera.getRay(u, v, lensSample, timeSample);
+}
+
+// A path between two bounces
+struct PathState
+{
+    PathState() {}
+    explicit PathState(const hq::math::Rayf& r)
+        : ray(r)
+        , origin(r.origin())
+    {
+    }
+
+    hq::math::Rayf     ray;
+    hq::math::Vector3f throughput = hq::math::Vector3f(1.f, 1.f, 1.f);  // product of the attenuations so far
+    hq::math::Vector3f radiance   = hq::math::Vector3f(0.f, 0.f, 0.f);  // gathered so far
+    // how ray was sampled, for weighting the emission it finds
+    hq::math::Vector3f origin;
+    float              bsdfPdf        = 0.f;
+    bool               specularBounce = true;
+    int                depth          = 0;
+    // ray cone for texture filtering: width at the ray origin and spread angle
+    float coneWidth  = 0.f;
+    float coneSpread = 0.f;
+};
+
+// Light sample of a path vertex that counts once its shadow ray reaches the light unoccluded
+struct LightConnection
+{
+    hq::math::Rayf     ray;
+    uint32_t           light;  // index in the lights
+    hq::math::Vector3f throughput;  // of the path at the vertex
+    hq::math::Vector3f f;           // BSDF times cosine
+    float              scale;       // MIS weight over pdf
+};
+
+// Unidirectional path tracer. The path is followed in a loop carrying the product of the
+// attenuations so far (throughput) and the radiance gathered so far, so the stack depth does
+// not grow with the number of bounces. From rouletteMinDepth bounces on paths are randomly
+// terminated with a probability that grows as their throughput drops (Russian roulette); the
+// survivors are reweighted so the estimate stays unbiased.
+// With lights set, every non-specular bounce also samples one of them directly (next event
+// estimation) and the light and BSDF strategies are combined with multiple importance
+// sampling, so small lights no longer have to be hit by chance.
+// The steps of a bounce are separate functions on a PathState, which the wavefront integrator
+// runs as stages over many paths.
+// Each path carries a ray cone (Akenine-Moller et al., "Texture Level of Detail Strategies for
+// Real-Time Ray Tracing") starting at one pixel wide, which gives the textures the footprint of
+// every hit. Specular bounces keep the spread, diffuse ones widen it to diffuseConeSpread.
+class PathIntegrator
+{
+public:
+    explicit PathIntegrator(const MaterialTable& materials, int maxDepth = 20, int rouletteMinDepth = 3)
+        : materials(materials)
+        , maxDepth(maxDepth)
+        , rouletteMinDepth(rouletteMinDepth)
+    {
+    }
+
+    // radiance arriving along r, rays counts the rays traced
+    hq::math::Vector3f radiance(const hq::math::Rayf& r, const Hitable& world, Sampler& sampler, uint64_t& rays) const
+    {
+        PathState path = startPath(r);
+        for (;;)
+        {
+            ++rays;
+            HitData hitData;
+            if (!world.hit(path.ray, 0.001f, std::numeric_limits<float>::max(), hitData))
+            {
+                //    float t  = 0.5f * (ray.direction().y + 1.f);
+                //    result += throughput * ((1.f - t) * Vector3f(1.f, 1.f, 1.f) + t * Vector3f(.3f, .5f, 1.f));
+                break;
+            }
+
+            spreadCone(path, hitData);
+            addEmission(path, hitData);
+            if (path.depth >= maxDepth)
+                break;
+
+            LightConnection connection;
+            if (connectLight(path, hitData, sampler, connection))
+            {
+                ++rays;
+                HitData lightHit;
+                if (world.hit(connection.ray, 0.001f, std::numeric_limits<float>::max(), lightHit))
+                    addLight(path, connection, lightHit);
+            }
+
+            if (!scatter(path, hitData, sampler))
+                break;
+        }
+
+        return path.radiance;
+    }
+
+    // path along a camera ray
+    PathState startPath(const hq::math::Rayf& r) const
+    {
+        PathState path(r);
+        path.coneSpread = pixelSpread;
+        return path;
+    }
+
+    // grows the path's ray cone to its hit and sets the texture footprint there
+    void spreadCone(PathState& path, HitData& hitData) const
+    {
+        const hq::math::Vector3f& direction = path.ray.direction();
+        float                     length    = std::sqrt(dot(direction, direction));
+        path.coneWidth += path.coneSpread * hitData.t * length;
+        float cosine      = std::max(std::fabs(dot(hitData.normal, direction)) / length, 0.01f);
+        hitData.footprint = path.coneWidth / std::max(cosine * hitData.uvScale, 1e-6f);
+    }
+
+    // adds the emission at the hit of the path's ray
+    void addEmission(PathState& path, const HitData& hitData) const
+    {
+        using namespace hq::math;
+
+        MaterialId material = hitData.materialId;
+        Vector3f   emitted  = materials.emitted(material, hitData.uv.u, hitData.uv.v, hitData.p, hitData.footprint);
+        if (emitted.r > 0.f || emitted.g > 0.f || emitted.b > 0.f)
+        {
+            // the light sampling at the previous vertex covered part of this already
+            float weight = 1.f;
+            if (!path.specularBounce && !lights.empty())
+                weight = powerHeuristic(path.bsdfPdf, lightPdf(path.origin, path.ray.time(), hitData.light));
+            path.radiance += weight * (path.throughput * emitted);
+        }
+    }
+
+    // Light sampling at a non-specular hit: one light picked uniformly, MIS weighted against
+    // the BSDF sampling strategy. False when there is nothing to trace a shadow ray for.
+    bool connectLight(const PathState& path, const HitData& hitData, Sampler& sampler,
+                      LightConnection& connection) const
+    {
+        using namespace hq::math;
+
+        if (lights.empty() || materials.isSpecular(hitData.materialId))
+            return false;
+
+        float time = path.ray.time();
+        sampler.setDimension(bounceDimension(path.depth, LightSelectOffset));
+        size_t             index = std::min(size_t(sampler.get1D() * float(lights.size())), lights.size() - 1);
+        const SphereLight& light = lights[index];
+        Vector2f           u     = sampler.get2D();
+        Vector3f           direction;
+        float              pdf;
+        if (!light.sample(hitData.p, time, u.u, u.v, direction, pdf))
+            return false;
+
+        Vector3f f = materials.evaluate(hitData.materialId, hitData, direction);
+        if (f.r <= 0.f && f.g <= 0.f && f.b <= 0.f)
+            return false;
+
+        pdf /= float(lights.size());
+        float weight          = powerHeuristic(pdf, materials.pdf(hitData.materialId, hitData, direction));
+        connection.ray        = Rayf(hitData.p, direction, time);
+        connection.light      = uint32_t(index);
+        connection.throughput = path.throughput;
+        connection.f          = f;
+        connection.scale      = weight / pdf;
+        return true;
+    }
+
+    // adds the light of connection when its shadow ray hit the light first, at lightHit
+    void addLight(PathState& path, const LightConnection& connection, const HitData& lightHit) const
+    {
+        if (lightHit.light != connection.light)
+            return;
+
+        hq::math::Vector3f emission =
+            materials.emitted(lightHit.materialId, lightHit.uv.u, lightHit.uv.v, lightHit.p, lightHit.footprint);
+        path.radiance += connection.throughput * (connection.scale * (connection.f * emission));
+    }
+
+    // Continues the path at hitData in the direction the material scatters into, with Russian
+    // roulette. False when the path ends.
+    bool scatter(PathState& path, const HitData& hitData, Sampler& sampler) const
+    {
+        using namespace hq::math;
+
+        MaterialId material = hitData.materialId;
+        Rayf       scattered;
+        Vector3f   attenuation;
+        sampler.setDimension(bounceDimension(path.depth, ScatterOffset));
+        if (!materials.scatter(material, path.ray, hitData, attenuation, scattered, sampler))
+            return false;
+
+        path.specularBounce = materials.isSpecular(material);
+        path.bsdfPdf        = path.specularBounce ? 0.f : materials.pdf(material, hitData, scattered.direction());
+        path.origin         = hitData.p;
+        path.throughput     = path.throughput * attenuation;
+        path.ray            = scattered;
+        if (!path.specularBounce)
+            path.coneSpread = std::max(path.coneSpread, diffuseConeSpread);
+
+        if (path.depth + 1 >= rouletteMinDepth)
+        {
+            // never certain death, bright paths keep a small chance of being cut as well
+            Vector3f& throughput = path.throughput;
+            float     survival   = std::min(std::max(std::max(throughput.r, throughput.g), throughput.b), 0.95f);
+            sampler.setDimension(bounceDimension(path.depth, RouletteOffset));
+            if (sampler.get1D() >= survival)
+                return false;
+            throughput = throughput / survival;
+        }
+        ++path.depth;
+        return true;
+    }
+
+    // density of connectLight() choosing a direction from p that hits lights[light], 0 for NoLight
+    float lightPdf(const hq::math::Vector3f& p, float time, uint32_t light) const
+    {
+        if (light >= lights.size())
+            return 0.f;
+        return lights[light].pdf(p, time) / float(lights.size());
+    }
+
+public:
+    const MaterialTable& materials;
+    int                  maxDepth;          // scattering events before a path is cut
+    int                  rouletteMinDepth;  // bounces before Russian roulette kicks in, more than maxDepth disables it
+
+    std::vector<SphereLight> lights;  // sampled directly, none disables next event estimation
+
+    float pixelSpread       = 0.f;   // angle between the camera rays of neighbouring pixels, 0 for the finest textures
+    float diffuseConeSpread = 0.1f;  // cone spread after a diffuse bounce, blurs textures only seen indirectly
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "BvhNode.h"
+#include "FlatBvh.h"
+#include "hitable.h"
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include <Hq/Math/Utils.h>
+
+// spreads the lower 10 bits of v so there are two zero bits between each of them
+uint32_t expandBits10(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// spreads the lower 21 bits of v so there are two zero bits between each of them
+uint64_t expandBits21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+// Morton code of a point with coordinates in [0, 1]. The x bits are the most significant of
+// every group of three, so bit b of a code splits along axis 2 - b % 3.
+template <typename MortonCode>
+MortonCode mortonCode(float x, float y, float z);
+
+// 30 bit codes, 10 bits per axis
+template <>
+uint32_t mortonCode<uint32_t>(float x, float y, float z)
+{
+    auto quantize = [](float value) { return uint32_t(hq::math::clamp(value * 1024.f, 0.f, 1023.f)); };
+    return (expandBits10(quantize(x)) << 2) | (expandBits10(quantize(y)) << 1) | expandBits10(quantize(z));
+}
+
+// 63 bit codes, 21 bits per axis
+template <>
+uint64_t mortonCode<uint64_t>(float x, float y, float z)
+{
+    auto quantize = [](float value) { return uint64_t(hq::math::clamp(value * 2097152.f, 0.f, 2097151.f)); };
+    return (expandBits21(quantize(x)) << 2) | (expandBits21(quantize(y)) << 1) | expandBits21(quantize(z));
+}
+
+// Linear BVH builder (Lauterbach et al.): primitives are ordered along a Morton curve of their
+// centroids with a radix sort and the hierarchy falls out of the bits of the sorted codes, so
+// no partitioning or SAH evaluation is needed. Trees are somewhat worse than the SAH builder's
+// but cheap enough to rebuild every frame of an animation. MortonCode is uint32_t for 30 bit
+// or uint64_t for 63 bit codes. Scratch buffers are kept between builds.
+template <typename MortonCode>
+class LinearBvhBuilder
+{
+public:
+    static const int CodeBits = sizeof(MortonCode) == 4 ? 30 : 63;
+
+    // Builds into bvh from the primitive bounds over [tMin, tMax]. Only maxLeafSize and
+    // traversalMode of options are used.
+    void build(FlatBvh& bvh, const std::vector<Hitable*>& list, float tMin, float tMax,
+               const BvhBuildOptions& options = BvhBuildOptions())
+    {
+        using namespace hq::math;
+
+        bvh.nodes.clear();
+        bvh.primitives.clear();
+        bvh.traversalMode    = options.traversalMode;
+        bvh.referenceSahCost = 0.f;
+        bvh.depth            = 0;
+        if (list.empty())
+            return;
+
+        bboxes.resize(list.size());
+        AABBf centroidBbox;
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+            if (!list[i]->boundingBox(tMin, tMax, bboxes[i]))
+            {
+                std::cerr << "No bounding box in LinearBvhBuilder\n";
+            }
+            Vector3f centroid = 0.5f * (bboxes[i].min() + bboxes[i].max());
+            AABBf    point(centroid, centroid);
+            centroidBbox = i == 0 ? point : surroundingBbox(centroidBbox, point);
+        }
+
+        Vector3f extent = centroidBbox.max() - centroidBbox.min();
+        Vector3f scale(extent.x > 0.f ? 1.f / extent.x : 0.f, extent.y > 0.f ? 1.f / extent.y : 0.f,
+                       extent.z > 0.f ? 1.f / extent.z : 0.f);
+        entries.resize(list.size());
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+            Vector3f centroid = 0.5f * (bboxes[i].min() + bboxes[i].max()) - centroidBbox.min();
+            entries[i].code   =
+                mortonCode<MortonCode>(centroid.x * scale.x, centroid.y * scale.y, centroid.z * scale.z);
+            entries[i].index  = uint32_t(i);
+        }
+        radixSort();
+
+        bvh.nodes.reserve(2 * list.size() / size_t(std::max(options.maxLeafSize, 1)) + 1);
+        bvh.primitives.reserve(list.size());
+        emit(bvh, list, 0, uint32_t(entries.size()), CodeBits - 1, std::max(options.maxLeafSize, 1), 1);
+        bvh.referenceSahCost = bvh.sahCost();
+        // one level per code bit plus halving the runs of equal codes
+        assert(bvh.depth <= FlatBvh::StackSize);
+    }
+
+private:
+    struct Entry
+    {
+        MortonCode code;
+        uint32_t   index;
+    };
+
+    // LSD radix sort on 8 bit digits, passes where every code has the same digit are skipped
+    void radixSort()
+    {
+        scratch.resize(entries.size());
+        for (int shift = 0; shift < CodeBits; shift += 8)
+        {
+            size_t histogram[256] = {};
+            for (const Entry& entry : entries)
+            {
+                ++histogram[(entry.code >> shift) & 0xff];
+            }
+            if (histogram[(entries.front().code >> shift) & 0xff] == entries.size())
+                continue;
+
+            size_t offset = 0;
+            for (size_t& count : histogram)
+            {
+                size_t digitCount = count;
+                count             = offset;
+                offset += digitCount;
+            }
+            for (const Entry& entry : entries)
+            {
+                scratch[histogram[(entry.code >> shift) & 0xff]++] = entry;
+            }
+            entries.swap(scratch);
+        }
+    }
+
+    // Emits the subtree of the sorted entries [first, last) in depth first order, bit is the
+    // highest code bit that may still differ inside the range. Returns the node index.
+    uint32_t emit(FlatBvh& bvh, const std::vector<Hitable*>& list, uint32_t first, uint32_t last, int bit,
+                  int maxLeafSize, int level)
+    {
+        bvh.depth      = std::max(bvh.depth, level);
+        uint32_t index = uint32_t(bvh.nodes.size());
+        bvh.nodes.emplace_back();
+        bvh.nodes[index].axis = 0;
+        bvh.nodes[index].pad  = 0;
+
+        if (last - first <= uint32_t(maxLeafSize))
+        {
+            hq::math::AABBf bbox = bboxes[entries[first].index];
+            for (uint32_t i = first; i < last; ++i)
+            {
+                bbox = surroundingBbox(bbox, bboxes[entries[i].index]);
+                bvh.primitives.push_back(list[entries[i].index]);
+            }
+            bvh.nodes[index].setBbox(bbox);
+            bvh.nodes[index].offset         = uint32_t(bvh.primitives.size()) - (last - first);
+            bvh.nodes[index].primitiveCount = uint16_t(last - first);
+            return index;
+        }
+
+        // the range is sorted so a bit differs inside it iff it differs between its ends
+        MortonCode firstCode = entries[first].code;
+        MortonCode lastCode  = entries[last - 1].code;
+        while (bit >= 0 && ((firstCode >> bit) & 1) == ((lastCode >> bit) & 1))
+        {
+            --bit;
+        }
+
+        uint32_t split;
+        if (bit < 0)
+        {
+            // identical codes, nothing left to tell them apart
+            split = first + (last - first) / 2;
+        }
+        else
+        {
+            // first entry with the bit set
+            uint32_t low  = first;
+            uint32_t high = last - 1;
+            while (low < high)
+            {
+                uint32_t middle = low + (high - low) / 2;
+                if ((entries[middle].code >> bit) & 1)
+                    high = middle;
+                else
+                    low = middle + 1;
+            }
+            split                 = low;
+            bvh.nodes[index].axis = uint8_t(2 - bit % 3);
+        }
+
+        uint32_t leftChild  = emit(bvh, list, first, split, bit - 1, maxLeafSize, level + 1);
+        uint32_t rightChild = emit(bvh, list, split, last, bit - 1, maxLeafSize, level + 1);
+        bvh.nodes[index].setBbox(surroundingBbox(bvh.nodes[leftChild].bbox(), bvh.nodes[rightChild].bbox()));
+        bvh.nodes[index].offset         = rightChild;
+        bvh.nodes[index].primitiveCount = 0;
+        return index;
+    }
+
+    std::vector<Entry>           entries;
+    std::vector<Entry>           scratch;
+    std::vector<hq::math::AABBf> bboxes;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <Hq/JobManager.h>
+
+// Number of chunks parallelFor() splits count items into when each chunk holds at least
+// minChunkSize items; a few chunks per hardware thread keep the workers balanced.
+size_t parallelChunkCount(size_t count, size_t minChunkSize)
+{
+    size_t threads   = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    size_t maxChunks = std::max<size_t>(count / std::max<size_t>(minChunkSize, 1), 1);
+    return std::min(threads * 4, maxChunks);
+}
+
+// Splits [0, count) into chunkCount contiguous ranges and runs function(chunkIndex, begin, end)
+// for each of them on the job manager. Blocks until all of them are done, so it must only be
+// called from outside the jobs.
+template <typename Function>
+void parallelFor(hq::JobManager& jobMgr, size_t count, size_t chunkCount, Function&& function)
+{
+    if (count == 0)
+        return;
+
+    chunkCount = std::max<size_t>(std::min(chunkCount, count), 1);
+    if (chunkCount == 1)
+    {
+        function(size_t(0), size_t(0), count);
+        return;
+    }
+
+    for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+    {
+        size_t begin = count * chunk / chunkCount;
+        size_t end   = count * (chunk + 1) / chunkCount;
+        jobMgr.addJob([&function, chunk, begin, end](void*, size_t) { function(chunk, begin, end); }, nullptr);
+    }
+    jobMgr.wait();
+}
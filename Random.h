@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+// PCG32 (O'Neill, XSH RR variant): 64 bits of state, 32 bit outputs and 2^63 selectable
+// streams. Every sample owns one, seeded from its pixel and sample index, so nothing is shared
+// between workers and a render comes out the same no matter how it is split across threads.
+class Pcg32
+{
+public:
+    Pcg32(uint64_t seed = 0x853c49e6748fea9bull, uint64_t stream = 0xda3e39cb94b95bdbull)
+    {
+        state     = 0u;
+        increment = (stream << 1u) | 1u;
+        nextUInt();
+        state += seed;
+        nextUInt();
+    }
+
+    uint32_t nextUInt()
+    {
+        uint64_t oldState   = state;
+        state               = oldState * 6364136223846793005ull + increment;
+        uint32_t xorShifted = uint32_t(((oldState >> 18u) ^ oldState) >> 27u);
+        uint32_t rotation   = uint32_t(oldState >> 59u);
+        return (xorShifted >> rotation) | (xorShifted << ((32u - rotation) & 31u));
+    }
+
+    // uniform in [0, 1), 24 bits so the float never rounds up to 1
+    float next01()
+    {
+        return float(nextUInt() >> 8) * (1.f / 16777216.f);
+    }
+
+private:
+    uint64_t state;
+    uint64_t increment;
+};
+
+// seed for the sampleIndex-th sample of a pixel, well mixed so neighbouring pixels decorrelate
+uint64_t sampleSeed(uint64_t pixelIndex, uint64_t sampleIndex)
+{
+    // splitmix64 finalizer
+    uint64_t z = pixelIndex * 0x9e3779b97f4a7c15ull + sampleIndex;
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
@@ -0,0 +1,405 @@
+#pragma once
+
+#include "BvhNode.h"
+#include "FlatBvh.h"
+#include "Framebuffer.h"
+#include "Integrator.h"
+#include "LinearBvhBuilder.h"
+#include "Sampler.h"
+#include "SphereSoA.h"
+#include "TileScheduler.h"
+#include "Wavefront.h"
+#include "WideBvh.h"
+#include "camera.h"
+#include "hitable.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <Hq/JobManager.h>
+#include <Hq/Math/Ray.h>
+#include <Hq/Math/Vector.h>
+
+struct RenderSettings
+{
+    uint32_t    width            = 800;
+    uint32_t    height           = 600;
+    int         samples          = 500;    // average samples per pixel of a finished frame
+    int         samplesPerPass   = 4;      // samples added to every pixel by each progressive pass
+    double      timeBudget       = 0.0;    // seconds after which no new pass is started, 0 for no limit
+    float       adaptiveError    = 0.02f;  // relative error at which a pixel stops sampling, 0 samples all alike
+    int         maxDepth         = 20;
+    int         rouletteMinDepth = 3;      // bounces before Russian roulette may end a path
+    bool        lightSampling    = true;   // next event estimation on the emissive spheres
+    int         bvhWidth         = 8;      // children per BVH node: 2, 4 or 8
+    bool        sphereSoA        = true;   // SIMD sphere batches in binary BVH leaves instead of a wide BVH
+    bool        linearBvh        = false;  // Morton code builder, quick enough to rebuild every frame, binary only
+    uint32_t    tileSize         = 16;     // tiles of tileSize x tileSize pixels are handed to the workers
+    TileOrder   tileOrder        = TileOrder::CenterOut;
+    SamplerType sampler          = SamplerType::Sobol;
+    uint64_t    seed             = 0;      // selects the random streams and scrambles, same seed renders the same image
+    bool        wavefront        = false;  // trace waves of paths stage by stage instead of tiles path by path
+    uint32_t    waveSize         = 65536;  // paths per wave of the wavefront integrator
+};
+
+// options of the tree builders for settings
+BvhBuildOptions bvhBuildOptions(const RenderSettings& settings)
+{
+    BvhBuildOptions bvhOptions;
+    bvhOptions.splitMethod   = BvhSplitMethod::Sah;
+    bvhOptions.traversalMode = BvhTraversalMode::Ordered;
+    if (settings.sphereSoA)
+    {
+        // a whole batch costs about as much as a single sphere, so let the SAH keep bigger leaves
+        bvhOptions.maxLeafSize   = SphereSoA::BatchWidth;
+        bvhOptions.traversalCost = 4.f;
+    }
+    return bvhOptions;
+}
+
+// Builds a binary tree over list into bvh with the builder the settings ask for. The SAH
+// builder reorders list.
+void buildFlatBvh(FlatBvh& bvh, std::vector<Hitable*>& list, const RenderSettings& settings,
+                  hq::JobManager& jobMgr)
+{
+    BvhBuildOptions bvhOptions = bvhBuildOptions(settings);
+    if (settings.linearBvh)
+    {
+        LinearBvhBuilder<uint64_t> builder;
+        builder.build(bvh, list, 0.f, 1.f, bvhOptions);
+        return;
+    }
+
+    BvhNode bvhRoot(list, 0.f, 1.f, bvhOptions, jobMgr);
+    bvh.flatten(bvhRoot);
+    bvhRoot.release();
+}
+
+// Builds the acceleration structure the settings ask for over list, which gets reordered.
+// Returns nullptr for an empty list.
+std::unique_ptr<Hitable> buildBvh(std::vector<Hitable*>& list, const RenderSettings& settings,
+                                  hq::JobManager& jobMgr)
+{
+    using namespace std::chrono;
+
+    if (list.empty())
+    {
+        std::cerr << "The scene is empty, no BVH built\n";
+        return nullptr;
+    }
+
+    BvhBuildOptions                   bvhOptions = bvhBuildOptions(settings);
+    high_resolution_clock::time_point buildStart = high_resolution_clock::now();
+    std::unique_ptr<Hitable>          bvh;
+    float                             sahCost;
+    if (settings.linearBvh)
+    {
+        if (!settings.sphereSoA && settings.bvhWidth != 2)
+            std::cerr << "The linear BVH builder only makes binary trees, ignoring bvhWidth\n";
+
+        std::unique_ptr<FlatBvh> tree(new FlatBvh());
+        buildFlatBvh(*tree, list, settings, jobMgr);
+        sahCost = tree->sahCost(bvhOptions);
+        if (settings.sphereSoA)
+            bvh.reset(new SphereBvh(*tree));
+        else
+            bvh = std::move(tree);
+    }
+    else
+    {
+        BvhNode bvhRoot(list, 0.f, 1.f, bvhOptions, jobMgr);
+        sahCost = bvhRoot.sahCost(bvhOptions);
+        bvh     = settings.sphereSoA ? std::unique_ptr<Hitable>(new SphereBvh(bvhRoot))
+                                     : createBvh(bvhRoot, settings.bvhWidth);
+        bvhRoot.release();
+    }
+    duration<double> buildTime = duration_cast<duration<double> >(high_resolution_clock::now() - buildStart);
+    std::cout << "BVH built in " << buildTime.count() * 1000.0 << " ms, SAH cost: " << sahCost << "\n";
+    return bvh;
+}
+
+// Brings bvh, made by buildBvh() over list, up to date once the primitives moved, e.g. for the
+// next frame of an animation. The bounds are refit in place, and the tree is built again by the
+// same builder when its SAH cost grew by more than maxSahDegradation. The wide trees keep no
+// SAH reference and are only refit. Returns true when the tree was rebuilt.
+bool updateBvh(Hitable& bvh, std::vector<Hitable*>& list, const RenderSettings& settings, hq::JobManager& jobMgr,
+               float maxSahDegradation = 0.25f)
+{
+    if (SphereBvh* sphereBvh = dynamic_cast<SphereBvh*>(&bvh))
+    {
+        sphereBvh->refit(0.f, 1.f);
+        if (!sphereBvh->bvh.sahDegraded(maxSahDegradation))
+            return false;
+
+        FlatBvh tree;
+        buildFlatBvh(tree, list, settings, jobMgr);
+        sphereBvh->build(tree);
+        return true;
+    }
+    if (FlatBvh* flatBvh = dynamic_cast<FlatBvh*>(&bvh))
+    {
+        flatBvh->refit(0.f, 1.f);
+        if (!flatBvh->sahDegraded(maxSahDegradation))
+            return false;
+
+        buildFlatBvh(*flatBvh, list, settings, jobMgr);
+        return true;
+    }
+
+    if (WideBvh<4>* wideBvh = dynamic_cast<WideBvh<4>*>(&bvh))
+        wideBvh->refit(0.f, 1.f);
+    else if (WideBvh<8>* wideBvh = dynamic_cast<WideBvh<8>*>(&bvh))
+        wideBvh->refit(0.f, 1.f);
+    return false;
+}
+
+// Progressive, adaptive frame renderer on top of the tile scheduler. Every pass adds
+// samplesPerPass samples to the pixels that still need some, the last one only what is left of
+// the budget; passes continue until the path budget of samples per pixel is used up, no pixel
+// needs samples or the time budget ran out.
+// start() and update() never block on the workers, so a UI can keep running meanwhile. In
+// wavefront mode the waves are traced from a thread of their own, which runs them on the workers.
+class Renderer
+{
+public:
+    Renderer(const RenderSettings& settings, const Camera& camera, const Hitable& world,
+             const MaterialTable& materials)
+        : settings(settings)
+        , framebuffer(settings.width, settings.height)
+        , integrator(materials, settings.maxDepth, settings.rouletteMinDepth)
+        , camera(camera)
+        , world(world)
+        , scheduler(settings.width, settings.height, settings.tileSize, settings.tileOrder)
+        , wavefront(integrator)
+    {
+        wavefront.samplerType = settings.sampler;
+        wavefront.strataCount = uint32_t(settings.samples);
+        wavefront.seed        = settings.seed;
+
+        integrator.pixelSpread    = camera.pixelSpread(settings.height);
+        adaptive.maxRelativeError = settings.adaptiveError;
+        adaptive.maxSamples       = uint32_t(settings.adaptiveError > 0.f ? 4 * settings.samples : settings.samples);
+    }
+
+    // starts the first pass
+    void start(hq::JobManager& jobMgr)
+    {
+        framebuffer.clear();
+        totalPaths = 0;
+        totalRays  = 0;
+        passPaths  = 0;
+        passRays   = 0;
+        rendering  = true;
+        startTime  = std::chrono::high_resolution_clock::now();
+        startPass(jobMgr);
+    }
+
+    // Starts the next pass once the current one completed. Returns false when the frame is done.
+    bool update(hq::JobManager& jobMgr)
+    {
+        if (!rendering || !scheduler.finished())
+            return rendering;
+
+        // the workers are about to return, wait for them before handing out the tiles again
+        waitForWorkers(jobMgr);
+        uint64_t paths = passPaths.exchange(0);
+        totalPaths += paths;
+        totalRays += passRays.exchange(0);
+        renderTime = std::chrono::high_resolution_clock::now() - startTime;
+
+        // converged pixels don't use up the budget, the noisy ones get up to adaptive.maxSamples
+        if (paths > 0 && totalPaths < pathBudget() &&
+            (settings.timeBudget <= 0.0 || renderTime.count() < settings.timeBudget))
+        {
+            startPass(jobMgr);
+            return true;
+        }
+
+        rendering = false;
+        return false;
+    }
+
+    // renders the whole frame, blocking
+    void render(hq::JobManager& jobMgr)
+    {
+        start(jobMgr);
+        do
+        {
+            waitForWorkers(jobMgr);
+        } while (update(jobMgr));
+    }
+
+    // stops after the tiles in flight
+    void cancel(hq::JobManager& jobMgr)
+    {
+        scheduler.cancel();
+        waitForWorkers(jobMgr);
+        if (rendering)
+        {
+            totalPaths += passPaths.exchange(0);
+            totalRays += passRays.exchange(0);
+            renderTime = std::chrono::high_resolution_clock::now() - startTime;
+            rendering  = false;
+        }
+    }
+
+    bool isRendering() const
+    {
+        return rendering;
+    }
+
+    // Calls function(tile) for every tile of the current pass that finished since the last call.
+    // Their pixels stay untouched until the next update() or cancel(), so function may read them
+    // in the framebuffer meanwhile, e.g. for a preview. Call from the thread calling update().
+    template <typename Function>
+    void takeCompletedTiles(Function&& function)
+    {
+        for (size_t i = 0; i < scheduler.tileCount(); ++i)
+        {
+            if (!tileTaken[i] && scheduler.tileCompleted(i))
+            {
+                tileTaken[i] = 1;
+                function(scheduler.tiles[i]);
+            }
+        }
+    }
+
+    double averageSamplesPerPixel() const
+    {
+        return double(totalPaths) / (double(settings.width) * double(settings.height));
+    }
+
+public:
+    RenderSettings   settings;
+    Framebuffer      framebuffer;
+    AdaptiveSampling adaptive;
+    PathIntegrator   integrator;
+
+    // statistics of the last frame, complete once it is done
+    uint64_t                      totalPaths = 0;
+    uint64_t                      totalRays  = 0;
+    std::chrono::duration<double> renderTime{0.0};
+
+private:
+    uint64_t pathBudget() const
+    {
+        return uint64_t(settings.samples) * settings.width * settings.height;
+    }
+
+    // hands out the tiles again, in wavefront mode to the thread tracing the waves
+    void startPass(hq::JobManager& jobMgr)
+    {
+        // no more samples per pixel than the budget has left, so 2 samples don't render 4
+        uint64_t pixelCount = uint64_t(settings.width) * settings.height;
+        uint64_t remaining  = pathBudget() - totalPaths;
+        uint64_t perPixel   = (remaining + pixelCount - 1) / pixelCount;
+        passSamples         = int(std::min<uint64_t>(uint64_t(settings.samplesPerPass), perPixel));
+        scheduler.restart();
+        tileTaken.assign(scheduler.tileCount(), 0);
+        // the waves are traced from a thread of their own so update() returns meanwhile
+        if (settings.wavefront)
+            waves = std::async(std::launch::async, [this, &jobMgr] {
+                while (traceWave(jobMgr))
+                {
+                }
+            });
+        else
+            scheduler.start(jobMgr, [this](const Tile& tile) { renderTile(tile); });
+    }
+
+    // the waves thread first, it is the one adding jobs in wavefront mode
+    void waitForWorkers(hq::JobManager& jobMgr)
+    {
+        if (waves.valid())
+            waves.wait();
+        jobMgr.wait();
+    }
+
+    // Takes tiles until they hold waveSize paths and traces them as one wave. Returns false when
+    // there were no tiles left.
+    bool traceWave(hq::JobManager& jobMgr)
+    {
+        Tile   tile;
+        size_t index;
+        waveTiles.clear();
+        wavePixels.clear();
+        while (wavePixels.size() * size_t(passSamples) < settings.waveSize && scheduler.next(tile, index))
+        {
+            waveTiles.push_back(index);
+            for (uint32_t y = tile.y0; y < tile.y1; ++y)
+            {
+                for (uint32_t x = tile.x0; x < tile.x1; ++x)
+                {
+                    if (adaptive.needsSamples(framebuffer, x, y))
+                        wavePixels.push_back(y * settings.width + x);
+                }
+            }
+        }
+        if (waveTiles.empty())
+            return false;
+
+        uint64_t rays = wavefront.trace(jobMgr, wavePixels, passSamples, camera, world, framebuffer);
+        passPaths.fetch_add(uint64_t(wavePixels.size()) * uint64_t(passSamples), std::memory_order_relaxed);
+        passRays.fetch_add(rays, std::memory_order_relaxed);
+        for (size_t waveTile : waveTiles)
+        {
+            scheduler.completeTile(waveTile);
+        }
+        return true;
+    }
+
+    void renderTile(const Tile& tile)
+    {
+        uint64_t                 paths   = 0;
+        uint64_t                 rays    = 0;
+        std::unique_ptr<Sampler> sampler = createSampler(settings.sampler, uint32_t(settings.samples), settings.seed);
+        for (uint32_t y = tile.y0; y < tile.y1; ++y)
+        {
+            for (uint32_t x = tile.x0; x < tile.x1; ++x)
+            {
+                if (!adaptive.needsSamples(framebuffer, x, y))
+                    continue;
+
+                uint64_t pixelIndex = uint64_t(y) * settings.width + x;
+                for (int i = 0; i < passSamples; ++i)
+                {
+                    // sample values only depend on pixel and sample index, not on the tile to thread mapping
+                    sampler->startSample(pixelIndex, framebuffer.sampleCount(x, y));
+                    hq::math::Rayf r = primaryRay(camera, *sampler, x, y, settings.width, settings.height);
+                    framebuffer.addSample(x, y, integrator.radiance(r, world, *sampler, rays));
+                }
+                paths += uint64_t(passSamples);
+            }
+        }
+        passPaths.fetch_add(paths, std::memory_order_relaxed);
+        passRays.fetch_add(rays, std::memory_order_relaxed);
+#ifdef RAYTRACEY_BVH_STATS
+        BvhStats::flushLocal();
+#endif
+    }
+
+    const Camera&  camera;
+    const Hitable& world;
+    TileScheduler  scheduler;
+
+    std::vector<uint8_t> tileTaken;  // per tile, handed to takeCompletedTiles() in the current pass
+
+    WavefrontIntegrator   wavefront;
+    std::vector<uint32_t> wavePixels;  // pixels of the current wave
+    std::vector<size_t>   waveTiles;   // indices of the tiles of the current wave
+
+    std::atomic<uint64_t> passPaths{0};  // paths traced by the current pass
+    std::atomic<uint64_t> passRays{0};
+    int                   passSamples = 0;  // samples per pixel of the current pass
+    bool                  rendering   = false;
+
+    std::chrono::high_resolution_clock::time_point startTime;
+
+    // Traces the waves of the current pass. Last, so destroying it waits for them before the
+    // state they use goes away.
+    std::future<void> waves;
+};
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "Framebuffer.h"
+#include "ParallelFor.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <Hq/JobManager.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// 8 bit sRGB-ish value of a linear radiance component, gamma 2
+uint8_t toDisplayByte(float value)
+{
+    return uint8_t(255.99f * std::sqrt(std::min(std::max(value, 0.f), 1.f)));
+}
+
+// 32 bit pixels with 8 bit channels at the given bit offsets, e.g. the window surface
+struct ResolveTarget
+{
+    uint8_t* pixels     = nullptr;
+    size_t   pitch      = 0;  // bytes between rows
+    uint32_t redShift   = 16;
+    uint32_t greenShift = 8;
+    uint32_t blueShift  = 0;
+    uint32_t alphaMask  = 0;  // or'ed into every pixel
+};
+
+// display pixel of the sums of one pixel over samples samples, black without samples
+uint32_t resolvePixel(const float* sum, uint32_t samples, const ResolveTarget& target)
+{
+    float scale = samples > 0 ? 1.f / float(samples) : 0.f;
+    return (uint32_t(toDisplayByte(sum[0] * scale)) << target.redShift) |
+           (uint32_t(toDisplayByte(sum[1] * scale)) << target.greenShift) |
+           (uint32_t(toDisplayByte(sum[2] * scale)) << target.blueShift) | target.alphaMask;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// toDisplayByte() of 4 components times scale, same rounding
+__m128i toDisplayBytes(__m128 value, __m128 scale)
+{
+    value = _mm_min_ps(_mm_max_ps(_mm_mul_ps(value, scale), _mm_setzero_ps()), _mm_set1_ps(1.f));
+    return _mm_cvttps_epi32(_mm_mul_ps(_mm_sqrt_ps(value), _mm_set1_ps(255.99f)));
+}
+
+// resolvePixel() of the 4 pixels starting at sum / samples
+__m128i resolvePixels4(const float* sum, const uint32_t* samples, const ResolveTarget& target)
+{
+    __m128 count = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(samples)));
+    // 1 / 0 is inf, masked to 0 for pixels without samples
+    __m128 scale = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.f), count), _mm_cmpgt_ps(count, _mm_setzero_ps()));
+    __m128 red   = _mm_setr_ps(sum[0], sum[3], sum[6], sum[9]);
+    __m128 green = _mm_setr_ps(sum[1], sum[4], sum[7], sum[10]);
+    __m128 blue  = _mm_setr_ps(sum[2], sum[5], sum[8], sum[11]);
+
+    __m128i pixels = _mm_set1_epi32(int(target.alphaMask));
+    pixels = _mm_or_si128(pixels, _mm_sll_epi32(toDisplayBytes(red, scale), _mm_cvtsi32_si128(int(target.redShift))));
+    pixels =
+        _mm_or_si128(pixels, _mm_sll_epi32(toDisplayBytes(green, scale), _mm_cvtsi32_si128(int(target.greenShift))));
+    pixels =
+        _mm_or_si128(pixels, _mm_sll_epi32(toDisplayBytes(blue, scale), _mm_cvtsi32_si128(int(target.blueShift))));
+    return pixels;
+}
+#endif
+
+#if defined(__AVX2__)
+__m256i toDisplayBytes(__m256 value, __m256 scale)
+{
+    value = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(value, scale), _mm256_setzero_ps()), _mm256_set1_ps(1.f));
+    return _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sqrt_ps(value), _mm256_set1_ps(255.99f)));
+}
+
+// resolvePixel() of the 8 pixels starting at sum / samples
+__m256i resolvePixels8(const float* sum, const uint32_t* samples, const ResolveTarget& target)
+{
+    __m256 count = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples)));
+    __m256 scale =
+        _mm256_and_ps(_mm256_div_ps(_mm256_set1_ps(1.f), count), _mm256_cmp_ps(count, _mm256_setzero_ps(), _CMP_GT_OQ));
+    __m256 red   = _mm256_setr_ps(sum[0], sum[3], sum[6], sum[9], sum[12], sum[15], sum[18], sum[21]);
+    __m256 green = _mm256_setr_ps(sum[1], sum[4], sum[7], sum[10], sum[13], sum[16], sum[19], sum[22]);
+    __m256 blue  = _mm256_setr_ps(sum[2], sum[5], sum[8], sum[11], sum[14], sum[17], sum[20], sum[23]);
+
+    __m256i pixels = _mm256_set1_epi32(int(target.alphaMask));
+    pixels = _mm256_or_si256(pixels,
+                             _mm256_sll_epi32(toDisplayBytes(red, scale), _mm_cvtsi32_si128(int(target.redShift))));
+    pixels = _mm256_or_si256(pixels,
+                             _mm256_sll_epi32(toDisplayBytes(green, scale), _mm_cvtsi32_si128(int(target.greenShift))));
+    pixels = _mm256_or_si256(pixels,
+                             _mm256_sll_epi32(toDisplayBytes(blue, scale), _mm_cvtsi32_si128(int(target.blueShift))));
+    return pixels;
+}
+#endif
+
+// Converts the running averages of the pixels [x0, x1) x [y0, y1) of framebuffer into target:
+// gamma, clamping and packing, several pixels at a time with SIMD
+void resolveRect(const Framebuffer& framebuffer, const ResolveTarget& target, uint32_t x0, uint32_t y0, uint32_t x1,
+                 uint32_t y1)
+{
+    for (uint32_t y = y0; y < y1; ++y)
+    {
+        const float*    sums    = framebuffer.accumulation.data() + size_t(y) * framebuffer.width * 3;
+        const uint32_t* samples = framebuffer.samples.data() + size_t(y) * framebuffer.width;
+        uint32_t*       row     = reinterpret_cast<uint32_t*>(target.pixels + size_t(y) * target.pitch);
+        uint32_t        x       = x0;
+#if defined(__AVX2__)
+        for (; x + 8 <= x1; x += 8)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + x), resolvePixels8(sums + 3 * x, samples + x, target));
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; x + 4 <= x1; x += 4)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), resolvePixels4(sums + 3 * x, samples + x, target));
+        }
+#endif
+        for (; x < x1; ++x)
+        {
+            row[x] = resolvePixel(sums + 3 * x, samples[x], target);
+        }
+    }
+}
+
+// resolveRect() of the whole rows [y0, y1)
+void resolveRows(const Framebuffer& framebuffer, const ResolveTarget& target, uint32_t y0, uint32_t y1)
+{
+    resolveRect(framebuffer, target, 0, y0, framebuffer.width, y1);
+}
+
+// Resolves the whole framebuffer with the rows split across the job manager. parallelFor()
+// waits for every job, so the job manager must not be busy with a render.
+void resolve(hq::JobManager& jobMgr, const Framebuffer& framebuffer, const ResolveTarget& target)
+{
+    parallelFor(jobMgr, framebuffer.height, parallelChunkCount(framebuffer.height, 16),
+                [&framebuffer, &target](size_t, size_t begin, size_t end) {
+                    resolveRows(framebuffer, target, uint32_t(begin), uint32_t(end));
+                });
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "Random.h"
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <Hq/Math/Vector.h>
+
+// Dimensions of a path sample. Each bounce owns a fixed block so a given dimension always
+// drives the same decision, which is what makes stratified and low discrepancy points help.
+enum SampleDimension : uint32_t
+{
+    PixelDimension  = 0,  // 2D jitter inside the pixel
+    LensDimension   = 2,  // 2D point on the lens
+    TimeDimension   = 4,  // shutter time
+    BounceDimension = 5,  // first bounce block
+};
+
+// offsets inside the block of a bounce
+enum BounceDimensionOffset : uint32_t
+{
+    LightSelectOffset    = 0,  // 1D light pick
+    LightDirectionOffset = 1,  // 2D direction towards the light
+    ScatterOffset        = 3,  // 2D + 1D for Material::scatter()
+    RouletteOffset       = 6,  // 1D Russian roulette
+    BounceDimensionCount = 7,
+};
+
+uint32_t bounceDimension(int depth, uint32_t offset)
+{
+    return BounceDimension + uint32_t(depth) * BounceDimensionCount + offset;
+}
+
+// Source of the sample values of a path. startSample() selects the sample, then get1D()/get2D()
+// hand out consecutive dimensions starting at the one set with setDimension(). The values only
+// depend on seed, pixel, sample and dimension, so a path can be suspended and picked up again
+// by any sampler, as the wavefront integrator does.
+class Sampler
+{
+public:
+    virtual ~Sampler() {}
+
+    void startSample(uint64_t pixelIndex, uint32_t sampleIndex)
+    {
+        this->pixelIndex  = pixelIndex;
+        this->sampleIndex = sampleIndex;
+        dimension         = 0;
+    }
+
+    void setDimension(uint32_t dimension)
+    {
+        this->dimension = dimension;
+    }
+
+    virtual float              get1D() = 0;
+    virtual hq::math::Vector2f get2D() = 0;
+
+public:
+    uint64_t seed = 0;  // selects the random streams / scrambles, the same seed renders the same image
+
+protected:
+    // random stream of a dimension of the current sample
+    Pcg32 dimensionRng(uint32_t dimension) const
+    {
+        return Pcg32(sampleSeed(sampleSeed(pixelIndex, sampleIndex), dimension), seed);
+    }
+
+    uint64_t pixelIndex  = 0;
+    uint32_t sampleIndex = 0;
+    uint32_t dimension   = 0;
+};
+
+// Plain uniform random numbers
+class IndependentSampler : public Sampler
+{
+public:
+    float get1D() override
+    {
+        return dimensionRng(dimension++).next01();
+    }
+
+    hq::math::Vector2f get2D() override
+    {
+        Pcg32 rng = dimensionRng(dimension);
+        dimension += 2;
+        float u = rng.next01();
+        return hq::math::Vector2f(u, rng.next01());
+    }
+};
+
+// hash of a pixel and a dimension, seeds the per dimension permutations and scrambles
+uint32_t dimensionHash(uint64_t pixelIndex, uint32_t dimension, uint64_t seed)
+{
+    return uint32_t(sampleSeed(pixelIndex ^ (seed << 40), dimension));
+}
+
+// Kensler's hashed permutation: element i of a random permutation of [0, count) picked by
+// seed, without storing the permutation
+uint32_t permuteIndex(uint32_t i, uint32_t count, uint32_t seed)
+{
+    uint32_t w = count - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= count);
+    return (i + seed) % count;
+}
+
+// Jittered strata over samplesPerPixel samples: count strata in 1D, a sqrt x sqrt grid in 2D.
+// Each dimension visits its strata in its own random order (padding), so dimensions don't
+// correlate. Samples past samplesPerPixel (adaptive sampling) start over the strata.
+class StratifiedSampler : public Sampler
+{
+public:
+    explicit StratifiedSampler(uint32_t samplesPerPixel)
+        : count(samplesPerPixel > 0 ? samplesPerPixel : 1)
+    {
+        gridSize = 1;
+        while ((gridSize + 1) * (gridSize + 1) <= count)
+        {
+            ++gridSize;
+        }
+    }
+
+    float get1D() override
+    {
+        uint32_t stratum = permuteIndex(sampleIndex % count, count, dimensionHash(pixelIndex, dimension, seed));
+        return (float(stratum) + dimensionRng(dimension++).next01()) / float(count);
+    }
+
+    hq::math::Vector2f get2D() override
+    {
+        uint32_t cells   = gridSize * gridSize;
+        uint32_t stratum = permuteIndex(sampleIndex % cells, cells, dimensionHash(pixelIndex, dimension, seed));
+        Pcg32    rng     = dimensionRng(dimension);
+        dimension += 2;
+        float u = (float(stratum % gridSize) + rng.next01()) / float(gridSize);
+        float v = (float(stratum / gridSize) + rng.next01()) / float(gridSize);
+        return hq::math::Vector2f(u, v);
+    }
+
+private:
+    uint32_t count;
+    uint32_t gridSize;
+};
+
+uint32_t reverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// Owen scrambling of the bits of x, seen as a fixed point fraction (Laine-Karras hash on the
+// reversed bits, Burley's "Practical Hash-based Owen Scrambling")
+uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// second Sobol dimension, the first one is just reverseBits(index)
+uint32_t sobolDimension1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// Owen-scrambled Sobol points. Every 1D/2D request takes the first one or two Sobol dimensions
+// with the sample index shuffled and the values scrambled by a hash of pixel and dimension
+// (Burley 2020), which keeps the stratification of every prefix of the sequence in each
+// dimension, so it also works for progressive and adaptive sample counts.
+class SobolSampler : public Sampler
+{
+public:
+    float get1D() override
+    {
+        uint32_t hash  = dimensionHash(pixelIndex, dimension++, seed);
+        uint32_t index = owenScramble(sampleIndex, hash);
+        return toFloat(owenScramble(reverseBits(index), hash * 0x9e3779b9u + 1u));
+    }
+
+    hq::math::Vector2f get2D() override
+    {
+        uint32_t hash  = dimensionHash(pixelIndex, dimension, seed);
+        uint32_t index = owenScramble(sampleIndex, hash);
+        dimension += 2;
+        float u = toFloat(owenScramble(reverseBits(index), hash * 0x9e3779b9u + 1u));
+        float v = toFloat(owenScramble(sobolDimension1(index), hash * 0x85ebca6bu + 2u));
+        return hq::math::Vector2f(u, v);
+    }
+
+private:
+    static float toFloat(uint32_t x)
+    {
+        return float(x >> 8) * (1.f / 16777216.f);
+    }
+};
+
+enum class SamplerType
+{
+    Independent,
+    Stratified,
+    Sobol
+};
+
+std::unique_ptr<Sampler> createSampler(SamplerType type, uint32_t samplesPerPixel, uint64_t seed)
+{
+    std::unique_ptr<Sampler> sampler;
+    switch (type)
+    {
+        case SamplerType::Independent:
+            sampler.reset(new IndependentSampler());
+            break;
+        case SamplerType::Stratified:
+            sampler.reset(new StratifiedSampler(samplesPerPixel));
+            break;
+        case SamplerType::Sobol:
+            sampler.reset(new SobolSampler());
+            break;
+        default:
+            std::cerr << "Unknown sampler type\n";
+            return nullptr;
+    }
+    sampler->seed = seed;
+    return sampler;
+}
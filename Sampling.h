@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <Hq/Math/Utils.h>
+#include <Hq/Math/Vector.h>
+
+// Closed form warps from uniform samples in [0, 1)^n. Unlike rejection sampling they consume a
+// fixed number of dimensions, which low discrepancy samplers need.
+
+// uniform direction on the unit sphere
+hq::math::Vector3f uniformSphere(const hq::math::Vector2f& sample)
+{
+    float z   = 1.f - 2.f * sample.u;
+    float r   = std::sqrt(std::max(0.f, 1.f - z * z));
+    float phi = 2.f * float(M_PI) * sample.v;
+    return hq::math::Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// uniform point inside the unit ball
+hq::math::Vector3f uniformBall(const hq::math::Vector2f& sample, float radiusSample)
+{
+    return std::cbrt(radiusSample) * uniformSphere(sample);
+}
+
+// Uniform point on the unit disk in the xy plane by Shirley and Chiu's concentric mapping,
+// which keeps the strata of the square compact on the disk, unlike the polar mapping
+hq::math::Vector3f concentricDisk(const hq::math::Vector2f& sample)
+{
+    float a          = 2.f * sample.u - 1.f;
+    float b          = 2.f * sample.v - 1.f;
+    bool  horizontal = std::fabs(a) > std::fabs(b);
+    float r          = horizontal ? a : b;
+    float ratio      = r != 0.f ? (horizontal ? b : a) / r : 0.f;
+    float phi        = horizontal ? float(M_PI) / 4.f * ratio : float(M_PI) / 2.f - float(M_PI) / 4.f * ratio;
+    return hq::math::Vector3f(r * std::cos(phi), r * std::sin(phi), 0.f);
+}
+
+// Cosine distributed direction around +z (Malley: a disk point lifted onto the hemisphere),
+// density cos(theta) / pi
+hq::math::Vector3f cosineHemisphere(const hq::math::Vector2f& sample)
+{
+    hq::math::Vector3f d = concentricDisk(sample);
+    d.z                  = std::sqrt(std::max(0.f, 1.f - d.x * d.x - d.y * d.y));
+    return d;
+}
+
+// Orthonormal basis around the unit vector w, without branches on the axis (Duff et al.,
+// "Building an Orthonormal Basis, Revisited")
+struct Onb
+{
+    explicit Onb(const hq::math::Vector3f& n)
+        : w(n)
+    {
+        float sign = std::copysign(1.f, n.z);
+        float a    = -1.f / (sign + n.z);
+        float b    = n.x * n.y * a;
+        u          = hq::math::Vector3f(1.f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+        v          = hq::math::Vector3f(b, sign + n.y * n.y * a, -n.y);
+    }
+
+    // local has z along w
+    hq::math::Vector3f toWorld(const hq::math::Vector3f& local) const
+    {
+        return local.x * u + local.y * v + local.z * w;
+    }
+
+    hq::math::Vector3f u, v, w;
+};
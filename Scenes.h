@@ -0,0 +1,152 @@
+#pragma once
+
+#include "HitableList.h"
+#include "camera.h"
+#include "material.h"
+#include "sphere.h"
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Hq/Math/Utils.h>
+#include <Hq/Math/Vector.h>
+#include <Hq/Rng.h>
+
+// the including translation unit defines STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+
+class StbImage
+{
+public:
+    StbImage() {}
+    bool load(const std::string& filename)
+    {
+        int channels;
+        _image = std::shared_ptr<unsigned char>(stbi_load(filename.c_str(), &_width, &_height, &channels, 4),
+                                                StbImage::freeImage);
+        return _image != nullptr;
+    }
+
+    const unsigned char* data() const
+    {
+        return _image.get();
+    }
+
+    int width() const
+    {
+        return _width;
+    }
+    int height() const
+    {
+        return _height;
+    }
+
+private:
+    static void freeImage(unsigned char* image)
+    {
+        stbi_image_free(image);
+    }
+    std::shared_ptr<unsigned char> _image  = {nullptr};
+    int                            _width  = {0};
+    int                            _height = {0};
+};
+
+void createRandomScene(HitableList& world, MaterialTable& materials)
+{
+    using namespace hq;
+    using namespace hq::math;
+
+    world.list.push_back(new Sphere(Vector3f(0.f, -1000.f, 0.f), 1000.f,
+                                    materials.add(makeLambertian(std::make_shared<CheckerTexture>(
+                                        std::make_shared<ColorTexture>(Vector3f(.5f, .5f, .5f)),
+                                        std::make_shared<ColorTexture>(Vector3f(.2f, .3f, .1f)))))));
+    for (int a = -11; a < 11; ++a)
+        for (int b = -11; b < 11; ++b)
+        {
+            float    chooseMat = rand01();
+            Vector3f center(a + 0.9f * rand01(), 0.2f, b + 0.9f * rand01());
+            if (length(center - Vector3f(4.f, .2f, 0.f)) > 0.9f)
+            {
+                if (chooseMat < .8f)
+                {
+                    world.list.push_back(
+                        new Sphere(center, .2f,
+                                   materials.add(makeLambertian(std::make_shared<ColorTexture>(
+                                       Vector3f(rand01() * rand01(), rand01() * rand01(), rand01() * rand01()))))));
+                }
+                else if (chooseMat < .95f)
+                {
+                    world.list.push_back(
+                        new Sphere(center, .2f,
+                                   materials.add(makeMetal(
+                                       Vector3f(.5f * (1 + rand01()), .5f * (1 + rand01()), .5f * (1 + rand01()))))));
+                }
+                else
+                {
+                    world.list.push_back(new Sphere(center, .2f, materials.add(makeDielectric(1.5f))));
+                }
+            }
+        }
+
+    world.list.push_back(new Sphere(Vector3f(0.f, 1.f, 0.f), 1.f, materials.add(makeDielectric(1.5f))));
+    world.list.push_back(
+        new Sphere(Vector3f(-4.f, 1.f, 0.f), 1.f,
+                   materials.add(makeLambertian(std::make_shared<ColorTexture>(Vector3f(.4f, .2f, .1f))))));
+    world.list.push_back(
+        new Sphere(Vector3f(4.f, 1.f, 0.f), 1.f, materials.add(makeMetal(Vector3f(.7f, .6f, .5f), 0.f))));
+}
+
+void createScenePerlinTest(HitableList& world, MaterialTable& materials)
+{
+    using namespace hq;
+    using namespace hq::math;
+
+    std::shared_ptr<NoiseTexture> noiseTexture = std::make_shared<NoiseTexture>(FastNoise::SimplexFractal);
+    noiseTexture->noise.SetFrequency(1.f);
+
+    MaterialId noiseMaterial = materials.add(makeLambertian(noiseTexture));
+    world.list.push_back(new Sphere(Vector3f(0.f, -1000.f, 0.f), 1000.f, noiseMaterial));
+    world.list.push_back(new Sphere(Vector3f(0.f, 2.f, 0.f), 2.f, materials.add(makeDielectric(1.5f))));
+    world.list.push_back(new Sphere(Vector3f(0.f, 2.f, 0.f), 1.5f, noiseMaterial));
+}
+
+std::vector<StbImage> createTexturedScene(HitableList& world, MaterialTable& materials)
+{
+    using namespace hq;
+    using namespace hq::math;
+
+    std::vector<StbImage> resources;
+
+    StbImage moon;
+    if (moon.load("assets/2k_moon.jpg"))
+    {
+        resources.emplace_back(moon);
+        std::shared_ptr<NoiseTexture> noiseTexture = std::make_shared<NoiseTexture>(FastNoise::SimplexFractal);
+
+        noiseTexture->noise.SetFrequency(1.f);
+        world.list.push_back(
+            new Sphere(Vector3f(0.f, -1000.f, 0.f), 1000.f, materials.add(makeLambertian(noiseTexture))));
+        world.list.push_back(new Sphere(
+            Vector3f(0.f, 2.f, 0.f), 1.5f,
+            materials.add(makeLambertian(std::make_shared<ImageTexture>(moon.data(), moon.width(), moon.height())))));
+        world.list.push_back(
+            new Sphere(Vector3f(1.f, 1.f, 2.f), 0.5f,
+                       materials.add(makeDiffuseLight(std::make_shared<ColorTexture>(Vector3f(1.f, 1.f, 1.f))))));
+    }
+    else
+    {
+        std::cerr << "Failed to load assets/2k_moon.jpg, the textured scene is empty\n";
+    }
+
+    return resources;
+}
+
+// camera looking at the textured scene, shared by the windowed and the headless renderer
+Camera createTexturedSceneCamera(float aspect)
+{
+    hq::math::Vector3f eye(6.5f, 2.f, 1.5f);
+    hq::math::Vector3f lookAt(0.f, 0.f, 0.f);
+    float              focusDist = length(eye - lookAt);
+    float              aperture  = 0.f;
+    return Camera(eye, lookAt, hq::math::Vector3f(0.f, 1.f, 0.f), 45, aspect, aperture, focusDist, 0.f, 1.f);
+}
@@ -0,0 +1,426 @@
+#pragma once
+
+#include "AlignedAllocator.h"
+#include "BvhNode.h"
+#include "FlatBvh.h"
+#include "hitable.h"
+#include "sphere.h"
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <Hq/Math/Utils.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// per ray data shared by all sphere batches tested by a traversal
+struct SphereBatchRay
+{
+    float origin[3];
+    float direction[3];
+    float time;
+    float a;  // dot(direction, direction)
+};
+
+// Spheres stored as a structure of arrays so a ray is tested against a whole batch of them
+// with SIMD instructions. The arrays are split into batches of BatchWidth spheres; padding
+// slots have NaN centers, which makes every comparison against them fail.
+class SphereSoA
+{
+public:
+#if defined(__AVX512F__)
+    static const int BatchWidth = 16;
+#elif defined(__AVX__)
+    static const int BatchWidth = 8;
+#else
+    static const int BatchWidth = 4;
+#endif
+
+    using FloatArray = std::vector<float, AlignedAllocator<float, 64> >;
+
+    void clear()
+    {
+        centerX.clear();
+        centerY.clear();
+        centerZ.clear();
+        radius.clear();
+        velocityX.clear();
+        velocityY.clear();
+        velocityZ.clear();
+        material.clear();
+        light.clear();
+    }
+
+    size_t size() const
+    {
+        return radius.size();
+    }
+
+    uint32_t add(const Sphere& sphere)
+    {
+        centerX.push_back(sphere.center.x);
+        centerY.push_back(sphere.center.y);
+        centerZ.push_back(sphere.center.z);
+        radius.push_back(sphere.radius);
+        velocityX.push_back(sphere.velocity.x);
+        velocityY.push_back(sphere.velocity.y);
+        velocityZ.push_back(sphere.velocity.z);
+        material.push_back(sphere.material);
+        light.push_back(sphere.light);
+        return uint32_t(size() - 1);
+    }
+
+    // overwrites the slot at index, e.g. with a sphere that moved since it was added
+    void set(uint32_t index, const Sphere& sphere)
+    {
+        centerX[index]   = sphere.center.x;
+        centerY[index]   = sphere.center.y;
+        centerZ[index]   = sphere.center.z;
+        radius[index]    = sphere.radius;
+        velocityX[index] = sphere.velocity.x;
+        velocityY[index] = sphere.velocity.y;
+        velocityZ[index] = sphere.velocity.z;
+        material[index]  = sphere.material;
+        light[index]     = sphere.light;
+    }
+
+    // pads with never hit spheres up to the next multiple of BatchWidth, or adds a whole batch
+    // of them when the batch starting at first is still empty
+    void padBatch(size_t first)
+    {
+        float nan = std::numeric_limits<float>::quiet_NaN();
+        while (size() % BatchWidth != 0 || size() == first)
+        {
+            centerX.push_back(nan);
+            centerY.push_back(nan);
+            centerZ.push_back(nan);
+            radius.push_back(0.f);
+            velocityX.push_back(0.f);
+            velocityY.push_back(0.f);
+            velocityZ.push_back(0.f);
+            material.push_back(0);
+            light.push_back(NoLight);
+        }
+    }
+
+    // Closest hit among the spheres [first, first + count), first and count being multiples of
+    // BatchWidth. Shrinks tMax and sets hitIndex on a hit.
+    bool intersect(const SphereBatchRay& ray, uint32_t first, uint32_t count, float tMin, float& tMax,
+                   uint32_t& hitIndex) const
+    {
+        bool hitAnything = false;
+        for (uint32_t batch = first; batch < first + count; batch += BatchWidth)
+        {
+            float t[BatchWidth];
+            int   mask = intersectBatch(ray, batch, tMin, tMax, t);
+            for (int lane = 0; mask != 0; ++lane, mask >>= 1)
+            {
+                if ((mask & 1) && t[lane] < tMax)
+                {
+                    tMax        = t[lane];
+                    hitIndex    = batch + uint32_t(lane);
+                    hitAnything = true;
+                }
+            }
+        }
+        return hitAnything;
+    }
+
+    void fillHitData(const hq::math::Rayf& r, float t, uint32_t index, HitData& hitData) const
+    {
+        using hq::math::Vector3f;
+        Vector3f center = Vector3f(centerX[index], centerY[index], centerZ[index]) +
+                          Vector3f(velocityX[index], velocityY[index], velocityZ[index]) * r.time();
+        hitData.t          = t;
+        hitData.p          = r.pointOnRay(t);
+        hitData.normal     = (hitData.p - center) / radius[index];
+        hitData.materialId = material[index];
+        hitData.light      = light[index];
+        hitData.uvScale    = sphereUvScale(hitData.normal, radius[index]);
+        GetSphereUV(hitData.normal, hitData.uv.u, hitData.uv.v);
+    }
+
+    static SphereBatchRay makeRay(const hq::math::Rayf& r)
+    {
+        SphereBatchRay ray;
+        ray.origin[0]    = r.origin().x;
+        ray.origin[1]    = r.origin().y;
+        ray.origin[2]    = r.origin().z;
+        ray.direction[0] = r.direction().x;
+        ray.direction[1] = r.direction().y;
+        ray.direction[2] = r.direction().z;
+        ray.time         = r.time();
+        ray.a            = dot(r.direction(), r.direction());
+        return ray;
+    }
+
+public:
+    FloatArray              centerX, centerY, centerZ;
+    FloatArray              radius;
+    FloatArray              velocityX, velocityY, velocityZ;
+    std::vector<MaterialId> material;
+    std::vector<uint32_t>   light;
+
+private:
+    // Same math as Sphere::intersect() for BatchWidth spheres starting at index. Returns the
+    // mask of lanes with a hit in (tMin, tMax) and their distances in t.
+    int intersectBatch(const SphereBatchRay& ray, uint32_t index, float tMin, float tMax, float* t) const;
+};
+
+#if defined(__AVX512F__)
+inline int SphereSoA::intersectBatch(const SphereBatchRay& ray, uint32_t index, float tMin, float tMax,
+                                     float* t) const
+{
+    __m512 time = _mm512_set1_ps(ray.time);
+    __m512 cx   = _mm512_fmadd_ps(_mm512_load_ps(&velocityX[index]), time, _mm512_load_ps(&centerX[index]));
+    __m512 cy   = _mm512_fmadd_ps(_mm512_load_ps(&velocityY[index]), time, _mm512_load_ps(&centerY[index]));
+    __m512 cz   = _mm512_fmadd_ps(_mm512_load_ps(&velocityZ[index]), time, _mm512_load_ps(&centerZ[index]));
+    __m512 ocx  = _mm512_sub_ps(_mm512_set1_ps(ray.origin[0]), cx);
+    __m512 ocy  = _mm512_sub_ps(_mm512_set1_ps(ray.origin[1]), cy);
+    __m512 ocz  = _mm512_sub_ps(_mm512_set1_ps(ray.origin[2]), cz);
+    __m512 dx   = _mm512_set1_ps(ray.direction[0]);
+    __m512 dy   = _mm512_set1_ps(ray.direction[1]);
+    __m512 dz   = _mm512_set1_ps(ray.direction[2]);
+    __m512 a    = _mm512_set1_ps(ray.a);
+    __m512 r    = _mm512_load_ps(&radius[index]);
+
+    __m512 b = _mm512_fmadd_ps(ocx, dx, _mm512_fmadd_ps(ocy, dy, _mm512_mul_ps(ocz, dz)));
+    __m512 c = _mm512_fmsub_ps(ocx, ocx, _mm512_fmsub_ps(r, r, _mm512_fmadd_ps(ocy, ocy, _mm512_mul_ps(ocz, ocz))));
+    __m512 discriminant = _mm512_fmsub_ps(b, b, _mm512_mul_ps(a, c));
+    __mmask16 valid     = _mm512_cmp_ps_mask(discriminant, _mm512_setzero_ps(), _CMP_GT_OQ);
+
+    __m512    root  = _mm512_sqrt_ps(_mm512_max_ps(discriminant, _mm512_setzero_ps()));
+    __m512    nearT = _mm512_div_ps(_mm512_sub_ps(_mm512_setzero_ps(), _mm512_add_ps(b, root)), a);
+    __m512    farT  = _mm512_div_ps(_mm512_sub_ps(root, b), a);
+    __m512    lo    = _mm512_set1_ps(tMin);
+    __m512    hi    = _mm512_set1_ps(tMax);
+    __mmask16 inNear =
+        _mm512_cmp_ps_mask(nearT, hi, _CMP_LT_OQ) & _mm512_cmp_ps_mask(nearT, lo, _CMP_GT_OQ) & valid;
+    __mmask16 inFar = _mm512_cmp_ps_mask(farT, hi, _CMP_LT_OQ) & _mm512_cmp_ps_mask(farT, lo, _CMP_GT_OQ) & valid;
+    _mm512_storeu_ps(t, _mm512_mask_blend_ps(inNear, farT, nearT));
+    return int(inNear | inFar);
+}
+#elif defined(__AVX__)
+inline int SphereSoA::intersectBatch(const SphereBatchRay& ray, uint32_t index, float tMin, float tMax,
+                                     float* t) const
+{
+    __m256 time = _mm256_set1_ps(ray.time);
+    __m256 cx   = _mm256_add_ps(_mm256_load_ps(&centerX[index]),
+                                _mm256_mul_ps(_mm256_load_ps(&velocityX[index]), time));
+    __m256 cy   = _mm256_add_ps(_mm256_load_ps(&centerY[index]),
+                                _mm256_mul_ps(_mm256_load_ps(&velocityY[index]), time));
+    __m256 cz   = _mm256_add_ps(_mm256_load_ps(&centerZ[index]),
+                                _mm256_mul_ps(_mm256_load_ps(&velocityZ[index]), time));
+    __m256 ocx  = _mm256_sub_ps(_mm256_set1_ps(ray.origin[0]), cx);
+    __m256 ocy  = _mm256_sub_ps(_mm256_set1_ps(ray.origin[1]), cy);
+    __m256 ocz  = _mm256_sub_ps(_mm256_set1_ps(ray.origin[2]), cz);
+    __m256 a    = _mm256_set1_ps(ray.a);
+    __m256 r    = _mm256_load_ps(&radius[index]);
+
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(ray.direction[0])),
+                                           _mm256_mul_ps(ocy, _mm256_set1_ps(ray.direction[1]))),
+                             _mm256_mul_ps(ocz, _mm256_set1_ps(ray.direction[2])));
+    __m256 c = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+        _mm256_mul_ps(r, r));
+    __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+    __m256 valid        = _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+    __m256 root   = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+    __m256 nearT  = _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_add_ps(b, root)), a);
+    __m256 farT   = _mm256_div_ps(_mm256_sub_ps(root, b), a);
+    __m256 lo     = _mm256_set1_ps(tMin);
+    __m256 hi     = _mm256_set1_ps(tMax);
+    __m256 inNear = _mm256_and_ps(
+        valid, _mm256_and_ps(_mm256_cmp_ps(nearT, hi, _CMP_LT_OQ), _mm256_cmp_ps(nearT, lo, _CMP_GT_OQ)));
+    __m256 inFar = _mm256_and_ps(
+        valid, _mm256_and_ps(_mm256_cmp_ps(farT, hi, _CMP_LT_OQ), _mm256_cmp_ps(farT, lo, _CMP_GT_OQ)));
+    _mm256_storeu_ps(t, _mm256_blendv_ps(farT, nearT, inNear));
+    return _mm256_movemask_ps(_mm256_or_ps(inNear, inFar));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+inline int SphereSoA::intersectBatch(const SphereBatchRay& ray, uint32_t index, float tMin, float tMax,
+                                     float* t) const
+{
+    __m128 time = _mm_set1_ps(ray.time);
+    __m128 cx   = _mm_add_ps(_mm_load_ps(&centerX[index]), _mm_mul_ps(_mm_load_ps(&velocityX[index]), time));
+    __m128 cy   = _mm_add_ps(_mm_load_ps(&centerY[index]), _mm_mul_ps(_mm_load_ps(&velocityY[index]), time));
+    __m128 cz   = _mm_add_ps(_mm_load_ps(&centerZ[index]), _mm_mul_ps(_mm_load_ps(&velocityZ[index]), time));
+    __m128 ocx  = _mm_sub_ps(_mm_set1_ps(ray.origin[0]), cx);
+    __m128 ocy  = _mm_sub_ps(_mm_set1_ps(ray.origin[1]), cy);
+    __m128 ocz  = _mm_sub_ps(_mm_set1_ps(ray.origin[2]), cz);
+    __m128 a    = _mm_set1_ps(ray.a);
+    __m128 r    = _mm_load_ps(&radius[index]);
+
+    __m128 b = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(ray.direction[0])), _mm_mul_ps(ocy, _mm_set1_ps(ray.direction[1]))),
+        _mm_mul_ps(ocz, _mm_set1_ps(ray.direction[2])));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                          _mm_mul_ps(r, r));
+    __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+    __m128 valid        = _mm_cmpgt_ps(discriminant, _mm_setzero_ps());
+
+    __m128 root   = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+    __m128 nearT  = _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(b, root)), a);
+    __m128 farT   = _mm_div_ps(_mm_sub_ps(root, b), a);
+    __m128 lo     = _mm_set1_ps(tMin);
+    __m128 hi     = _mm_set1_ps(tMax);
+    __m128 inNear = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(nearT, hi), _mm_cmpgt_ps(nearT, lo)));
+    __m128 inFar  = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(farT, hi), _mm_cmpgt_ps(farT, lo)));
+    _mm_storeu_ps(t, _mm_or_ps(_mm_and_ps(inNear, nearT), _mm_andnot_ps(inNear, farT)));
+    return _mm_movemask_ps(_mm_or_ps(inNear, inFar));
+}
+#else
+inline int SphereSoA::intersectBatch(const SphereBatchRay& ray, uint32_t index, float tMin, float tMax,
+                                     float* t) const
+{
+    int mask = 0;
+    for (int lane = 0; lane < BatchWidth; ++lane)
+    {
+        uint32_t i            = index + uint32_t(lane);
+        float    ocx          = ray.origin[0] - (centerX[i] + velocityX[i] * ray.time);
+        float    ocy          = ray.origin[1] - (centerY[i] + velocityY[i] * ray.time);
+        float    ocz          = ray.origin[2] - (centerZ[i] + velocityZ[i] * ray.time);
+        float    b            = ocx * ray.direction[0] + ocy * ray.direction[1] + ocz * ray.direction[2];
+        float    c            = ocx * ocx + ocy * ocy + ocz * ocz - radius[i] * radius[i];
+        float    discriminant = b * b - ray.a * c;
+        if (!(discriminant > 0.f))
+            continue;
+
+        float root  = std::sqrt(discriminant);
+        float nearT = (-b - root) / ray.a;
+        float farT  = (-b + root) / ray.a;
+        if (nearT < tMax && nearT > tMin)
+            t[lane] = nearT;
+        else if (farT < tMax && farT > tMin)
+            t[lane] = farT;
+        else
+            continue;
+        mask |= 1 << lane;
+    }
+    return mask;
+}
+#endif
+
+// Binary BVH whose leaves index batches of a SphereSoA instead of Hitable pointers. Every
+// primitive of the source tree has to be a Sphere; leaves are padded to whole batches, so
+// building with maxLeafSize = SphereSoA::BatchWidth wastes the least. The batches are copies,
+// moved spheres are picked up by refit() or refitOrRebuild() of this class, not of bvh.
+class SphereBvh : public Hitable
+{
+public:
+    SphereBvh() {}
+    explicit SphereBvh(const BvhNode& root)
+    {
+        build(root);
+    }
+    explicit SphereBvh(const FlatBvh& tree)
+    {
+        build(tree);
+    }
+
+    void build(const BvhNode& root)
+    {
+        bvh.flatten(root);
+        batchLeaves();
+    }
+
+    // from a tree that is flat already, e.g. one of the LinearBvhBuilder
+    void build(const FlatBvh& tree)
+    {
+        bvh = tree;
+        batchLeaves();
+    }
+
+    // Copies the spheres the tree was built from into the batches again and recomputes the
+    // bounds over [tMin, tMax], keeping the topology.
+    void refit(float tMin, float tMax)
+    {
+        for (size_t i = 0; i < bvh.primitives.size(); ++i)
+        {
+            if (bvh.primitives[i] != nullptr)
+                spheres.set(uint32_t(i), *static_cast<const Sphere*>(bvh.primitives[i]));
+        }
+        bvh.refit(tMin, tMax);
+    }
+
+    // Refits, then rebuilds with options when the SAH cost grew by more than maxSahDegradation,
+    // as FlatBvh::refitOrRebuild() does. Returns true when the tree was rebuilt.
+    bool refitOrRebuild(float tMin, float tMax, const BvhBuildOptions& options, float maxSahDegradation = 0.25f)
+    {
+        refit(tMin, tMax);
+        if (!bvh.sahDegraded(maxSahDegradation))
+            return false;
+
+        std::vector<Hitable*> list;
+        for (Hitable* hitable : bvh.primitives)
+        {
+            if (hitable != nullptr)
+                list.push_back(hitable);
+        }
+        BvhNode root(list, tMin, tMax, options);
+        build(root);
+        root.release();
+        return true;
+    }
+
+    bool hit(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const override
+    {
+        SphereBatchRay ray           = SphereSoA::makeRay(r);
+        uint32_t       sphereIndex   = 0;
+        auto           intersectLeaf = [this, &ray](const FlatBvhNode& leaf, float rayTMin, float& closest,
+                                          uint32_t& hitIndex) {
+            return spheres.intersect(ray, leaf.offset, leaf.primitiveCount, rayTMin, closest, hitIndex);
+        };
+
+        if (!bvh.traverse(r, tMin, tMax, sphereIndex, intersectLeaf))
+            return false;
+
+        spheres.fillHitData(r, tMax, sphereIndex, hitData);
+        return true;
+    }
+
+    bool boundingBox(float tMin, float tMax, hq::math::AABBf& bbox) const override
+    {
+        return bvh.boundingBox(tMin, tMax, bbox);
+    }
+
+public:
+    FlatBvh   bvh;  // leaves index spheres, primitives holds the Sphere of every slot, nullptr for padding
+    SphereSoA spheres;
+
+private:
+    // copies the spheres of every leaf into the batches, which the leaves index from then on
+    void batchLeaves()
+    {
+        std::vector<Hitable*> hitables;
+        hitables.swap(bvh.primitives);
+        spheres.clear();
+        for (FlatBvhNode& node : bvh.nodes)
+        {
+            if (!node.isLeaf())
+                continue;
+
+            uint32_t first = uint32_t(spheres.size());
+            for (uint32_t i = node.offset; i < node.offset + node.primitiveCount; ++i)
+            {
+                Sphere* sphere = dynamic_cast<Sphere*>(hitables[i]);
+                if (sphere == nullptr)
+                {
+                    std::cerr << "SphereBvh only supports Sphere primitives\n";
+                    continue;
+                }
+                spheres.add(*sphere);
+                bvh.primitives.push_back(sphere);
+            }
+            spheres.padBatch(first);
+            bvh.primitives.resize(spheres.size(), nullptr);
+            node.offset         = first;
+            node.primitiveCount = uint16_t(spheres.size() - first);
+        }
+        // the padding counts as intersections too, refitOrRebuild() compares against this
+        bvh.referenceSahCost = bvh.sahCost();
+    }
+};
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <Hq/Math/Vector.h>
+#include <algorithm>
+#include <cmath>
 #include <memory>
+#include <vector>
+#include "AlignedAllocator.h"
 #include "FastNoise/FastNoise.h"
 #include <Hq/Math/Utils.h>
 #include <assert.h>
@@ -10,7 +14,8 @@ class Texture
 {
 public:
     virtual ~Texture() {}
-    virtual hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p) const = 0;
+    // footprint is the width of the area seen by the ray in uv units, 0 for the finest detail
+    virtual hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p, float footprint) const = 0;
 };
 
 using TexturePtr = std::shared_ptr<Texture>;
@@ -24,7 +29,8 @@ public:
     {
     }
 
-    hq::math::Vector3f value(float /*u*/, float /*v*/, const hq::math::Vector3f& /*p*/) const override
+    hq::math::Vector3f value(float /*u*/, float /*v*/, const hq::math::Vector3f& /*p*/,
+                             float /*footprint*/) const override
     {
         return color;
     }
@@ -42,13 +48,13 @@ public:
     {
     }
 
-    hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p) const override
+    hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p, float footprint) const override
     {
         float sines = std::sin(10 * p.x) * std::sin(10 * p.y) * std::sin(10 * p.z);
         if (sines < 0)
-            return oddTexture->value(u, v, p);
+            return oddTexture->value(u, v, p, footprint);
         else
-            return evenTexture->value(u, v, p);
+            return evenTexture->value(u, v, p, footprint);
     }
 
     TexturePtr evenTexture;
@@ -63,10 +69,11 @@ public:
     {
         noise.SetNoiseType(noiseType);
     }
-    hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p) const override
+    hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p, float footprint) const override
     {
         (void)u;
         (void)v;
+        (void)footprint;
         using hq::math::Vector3f;
         return Vector3f(1.f, 1.f, 1.f) * ((noise.GetNoise(p.x, p.y, p.z) + 1.f) / 2.f);
     }
@@ -74,34 +81,166 @@ public:
     FastNoise noise;
 };
 
+// One level of an image pyramid, RGBA8 in 4x4 texel tiles of one cache line each, so the
+// texels around a lookup share lines in both directions instead of rows width * 4 bytes apart.
+// texel() hides the layout.
+class MipLevel
+{
+public:
+    static const int TileSize = 4;
+
+    MipLevel() {}
+    MipLevel(int width, int height)
+        : width(width)
+        , height(height)
+        , tilesX((width + TileSize - 1) / TileSize)
+    {
+        size_t tilesY = size_t((height + TileSize - 1) / TileSize);
+        texels.resize(4 * TileSize * TileSize * size_t(tilesX) * tilesY);
+    }
+
+    // copies row major RGBA8 data
+    MipLevel(const unsigned char* data, int width, int height)
+        : MipLevel(width, height)
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                std::copy(data + 4 * (size_t(y) * size_t(width) + size_t(x)),
+                          data + 4 * (size_t(y) * size_t(width) + size_t(x)) + 4, texel(x, y));
+            }
+        }
+    }
+
+    const unsigned char* texel(int x, int y) const
+    {
+        return &texels[texelOffset(x, y)];
+    }
+
+    unsigned char* texel(int x, int y)
+    {
+        return &texels[texelOffset(x, y)];
+    }
+
+    int width  = 0;
+    int height = 0;
+
+private:
+    size_t texelOffset(int x, int y) const
+    {
+        size_t tx   = size_t(x);
+        size_t ty   = size_t(y);
+        size_t tile = ty / TileSize * size_t(tilesX) + tx / TileSize;
+        return 4 * (tile * TileSize * TileSize + ty % TileSize * TileSize + tx % TileSize);
+    }
+
+    int                                                              tilesX = 0;
+    std::vector<unsigned char, AlignedAllocator<unsigned char, 64> > texels;
+};
+
+// Image with a mip pyramid built at construction, sampled trilinearly at the level whose texels
+// match the footprint of the ray, so minified lookups stay in small, cache resident levels and
+// don't alias.
 class ImageTexture : public Texture
 {
 public:
     ImageTexture() = delete;
-    // data is always 4 channels (RGBA)
+    // data is always 4 channels (RGBA), copied
     ImageTexture(const unsigned char* data, int width, int height)
-        : data(data)
-        , width(width)
+        : width(width)
         , height(height)
     {
+        levels.push_back(MipLevel(data, width, height));
+        while (levels.back().width > 1 || levels.back().height > 1)
+        {
+            levels.push_back(downsample(levels.back()));
+        }
     }
 
-    hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p) const override
+    hq::math::Vector3f value(float u, float v, const hq::math::Vector3f& p, float footprint) const override
     {
         (void)p;
-        assert(0 <= u <= 1);
-        assert(0 <= v <= 1);
-        using vec3 = hq::math::Vector3f;
-        using namespace hq::math;
-        int   i = clamp(int(u * width), 0, width - 1);
-        int   j = clamp(int((1.f - v) * height), 0, height - 1);
-        float r = int(data[4 * (i + width * j)]) / 255.f;
-        float g = int(data[4 * (i + width * j) + 1]) / 255.f;
-        float b = int(data[4 * (i + width * j) + 2]) / 255.f;
-        return vec3(r, g, b);
+        assert(u >= 0.f && u <= 1.f);
+        assert(v >= 0.f && v <= 1.f);
+
+        // footprint in texels of the full image, one texel or less reads level 0
+        float footprintTexels = footprint * std::sqrt(float(width) * float(height));
+        float lod             = std::min(std::log2(std::max(footprintTexels, 1.f)), float(levels.size() - 1));
+        int   level0          = int(lod);
+        int   level1          = std::min(level0 + 1, int(levels.size()) - 1);
+        float blend           = lod - float(level0);
+
+        hq::math::Vector3f color = bilinear(levels[level0], u, v);
+        if (blend > 0.f)
+            color = (1.f - blend) * color + blend * bilinear(levels[level1], u, v);
+        return color;
     }
 
-    const unsigned char* data;
-    int                  width;
-    int                  height;
+    int width;
+    int height;
+
+    std::vector<MipLevel> levels;  // levels[0] is the full image, each next one half the size
+
+private:
+    // 2x2 box filter, the last row or column of an odd size is folded into its neighbour
+    static MipLevel downsample(const MipLevel& source)
+    {
+        MipLevel level(std::max(source.width / 2, 1), std::max(source.height / 2, 1));
+        for (int y = 0; y < level.height; ++y)
+        {
+            int y0 = std::min(2 * y, source.height - 1);
+            int y1 = y == level.height - 1 ? source.height - 1 : 2 * y + 1;
+            for (int x = 0; x < level.width; ++x)
+            {
+                int x0 = std::min(2 * x, source.width - 1);
+                int x1 = x == level.width - 1 ? source.width - 1 : 2 * x + 1;
+                for (int c = 0; c < 4; ++c)
+                {
+                    int sum = 0, count = 0;
+                    for (int sy = y0; sy <= y1; ++sy)
+                    {
+                        for (int sx = x0; sx <= x1; ++sx)
+                        {
+                            sum += source.texel(sx, sy)[c];
+                            ++count;
+                        }
+                    }
+                    level.texel(x, y)[c] = (unsigned char)((sum + count / 2) / count);
+                }
+            }
+        }
+        return level;
+    }
+
+    // bilinear lookup with clamp to edge, v = 0 is the bottom row
+    static hq::math::Vector3f bilinear(const MipLevel& level, float u, float v)
+    {
+        using namespace hq::math;
+        float x  = u * float(level.width) - 0.5f;
+        float y  = (1.f - v) * float(level.height) - 0.5f;
+        float fx = std::floor(x);
+        float fy = std::floor(y);
+        float tx = x - fx;
+        float ty = y - fy;
+        int   x0 = clamp(int(fx), 0, level.width - 1);
+        int   x1 = clamp(int(fx) + 1, 0, level.width - 1);
+        int   y0 = clamp(int(fy), 0, level.height - 1);
+        int   y1 = clamp(int(fy) + 1, 0, level.height - 1);
+
+        const unsigned char* t00 = level.texel(x0, y0);
+        const unsigned char* t10 = level.texel(x1, y0);
+        const unsigned char* t01 = level.texel(x0, y1);
+        const unsigned char* t11 = level.texel(x1, y1);
+        float                w00 = (1.f - tx) * (1.f - ty);
+        float                w10 = tx * (1.f - ty);
+        float                w01 = (1.f - tx) * ty;
+        float                w11 = tx * ty;
+        float                rgb[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            rgb[c] = (w00 * t00[c] + w10 * t10[c] + w01 * t01[c] + w11 * t11[c]) / 255.f;
+        }
+        return Vector3f(rgb[0], rgb[1], rgb[2]);
+    }
 };
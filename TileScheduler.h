@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <Hq/JobManager.h>
+
+// Pixel rectangle [x0, x1) x [y0, y1)
+struct Tile
+{
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+};
+
+enum class TileOrder
+{
+    ScanLine,
+    CenterOut,  // nearest to the image center first
+    Hilbert     // along a Hilbert curve, neighbouring tiles finish close in time
+};
+
+// Distance of (x, y) along the Hilbert curve covering an n x n grid, n a power of two
+uint32_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2)
+    {
+        uint32_t rx = (x & s) > 0 ? 1 : 0;
+        uint32_t ry = (y & s) > 0 ? 1 : 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so the sub curve is traversed in the right orientation
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Splits a frame into tiles which workers pull from a shared atomic counter until none are
+// left, so there is no barrier between tiles and idle workers simply grab the next one.
+// Finished tiles are published one by one (tileCompleted()), so their pixels can be read
+// while the other tiles are still being rendered.
+// The scheduler has to outlive the jobs started with start(): cancel() and wait on the job
+// manager before destroying it.
+class TileScheduler
+{
+public:
+    TileScheduler(uint32_t width, uint32_t height, uint32_t tileSize, TileOrder order = TileOrder::CenterOut)
+    {
+        reset(width, height, tileSize, order);
+    }
+
+    void reset(uint32_t width, uint32_t height, uint32_t tileSize, TileOrder order)
+    {
+        tileSize         = std::max<uint32_t>(tileSize, 1);
+        uint32_t tilesX  = (width + tileSize - 1) / tileSize;
+        uint32_t tilesY  = (height + tileSize - 1) / tileSize;
+        uint32_t gridMax = std::max(tilesX, tilesY);
+        uint32_t gridPow = 1;
+        while (gridPow < gridMax)
+        {
+            gridPow *= 2;
+        }
+
+        struct OrderedTile
+        {
+            Tile  tile;
+            float key;
+        };
+        std::vector<OrderedTile> ordered;
+        ordered.reserve(size_t(tilesX) * tilesY);
+        for (uint32_t ty = 0; ty < tilesY; ++ty)
+        {
+            for (uint32_t tx = 0; tx < tilesX; ++tx)
+            {
+                OrderedTile entry;
+                entry.tile.x0 = tx * tileSize;
+                entry.tile.y0 = ty * tileSize;
+                entry.tile.x1 = std::min(entry.tile.x0 + tileSize, width);
+                entry.tile.y1 = std::min(entry.tile.y0 + tileSize, height);
+                switch (order)
+                {
+                    case TileOrder::ScanLine:
+                        entry.key = float(ordered.size());
+                        break;
+                    case TileOrder::CenterOut:
+                    {
+                        float dx  = 0.5f * float(entry.tile.x0 + entry.tile.x1) - 0.5f * float(width);
+                        float dy  = 0.5f * float(entry.tile.y0 + entry.tile.y1) - 0.5f * float(height);
+                        entry.key = dx * dx + dy * dy;
+                        break;
+                    }
+                    case TileOrder::Hilbert:
+                        entry.key = float(hilbertIndex(gridPow, tx, ty));
+                        break;
+                }
+                ordered.push_back(entry);
+            }
+        }
+        std::stable_sort(ordered.begin(), ordered.end(),
+                         [](const OrderedTile& a, const OrderedTile& b) { return a.key < b.key; });
+
+        tiles.clear();
+        for (const OrderedTile& entry : ordered)
+        {
+            tiles.push_back(entry.tile);
+        }
+        tileDone.reset(new std::atomic<uint8_t>[tiles.size()]);
+        restart();
+    }
+
+    // Hands out the same tiles again, e.g. for the next pass of a progressive render. The jobs
+    // of the previous start() must have returned.
+    void restart()
+    {
+        nextTile       = 0;
+        completedTiles = 0;
+        cancelled      = false;
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            tileDone[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Hands out the next tile and its index, false once all are taken or the frame was cancelled
+    bool next(Tile& tile, size_t& index)
+    {
+        if (cancelled.load(std::memory_order_relaxed))
+            return false;
+
+        index = nextTile.fetch_add(1, std::memory_order_relaxed);
+        if (index >= tiles.size())
+            return false;
+
+        tile = tiles[index];
+        return true;
+    }
+
+    // Adds workerCount jobs (one per hardware thread when 0) that run renderTile(tile) for
+    // tiles until none are left. Does not wait for them.
+    template <typename TileRenderer>
+    void start(hq::JobManager& jobMgr, TileRenderer renderTile, size_t workerCount = 0)
+    {
+        if (workerCount == 0)
+            workerCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+        for (size_t worker = 0; worker < workerCount; ++worker)
+        {
+            jobMgr.addJob(
+                [this, renderTile](void*, size_t) {
+                    Tile   tile;
+                    size_t index;
+                    while (next(tile, index))
+                    {
+                        renderTile(tile);
+                        completeTile(index);
+                    }
+                },
+                nullptr);
+        }
+    }
+
+    // publishes tile index taken with next() as rendered, for callers that render without start()
+    void completeTile(size_t index)
+    {
+        tileDone[index].store(1, std::memory_order_release);
+        completedTiles.fetch_add(1, std::memory_order_release);
+    }
+
+    // true once tile index of the current pass is rendered, its pixels are then safe to read
+    // until restart()
+    bool tileCompleted(size_t index) const
+    {
+        return tileDone[index].load(std::memory_order_acquire) != 0;
+    }
+
+    void cancel()
+    {
+        cancelled = true;
+    }
+
+    bool isCancelled() const
+    {
+        return cancelled.load();
+    }
+
+    // all tiles rendered
+    bool finished() const
+    {
+        return completedTiles.load(std::memory_order_acquire) == tiles.size();
+    }
+
+    size_t tileCount() const
+    {
+        return tiles.size();
+    }
+
+    size_t completedTileCount() const
+    {
+        return completedTiles.load(std::memory_order_acquire);
+    }
+
+public:
+    std::vector<Tile> tiles;  // in the order they are handed out
+
+private:
+    std::atomic<size_t> nextTile{0};
+    std::atomic<size_t> completedTiles{0};
+    std::atomic<bool>   cancelled{false};
+
+    std::unique_ptr<std::atomic<uint8_t>[]> tileDone;  // per tile, set once it is rendered
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "BvhNode.h"
+#include "Framebuffer.h"
+#include "Integrator.h"
+#include "ParallelFor.h"
+#include "Sampler.h"
+#include "camera.h"
+#include "hitable.h"
+#include "material.h"
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <vector>
+#include <Hq/JobManager.h>
+
+// Path tracer that advances a whole wave of paths one stage at a time instead of following
+// each path to its end: extend (closest hit of every active ray), shade (emission, light
+// sample and scattering, with the paths binned by material type so each kernel runs over a
+// coherent batch), shadow (the light sample rays) and compaction of the survivors. Every stage
+// is a parallelFor over the job manager. Uses the bounce functions of a PathIntegrator, so the
+// result is the same as path by path, just in a cache and branch friendlier order.
+class WavefrontIntegrator
+{
+public:
+    explicit WavefrontIntegrator(const PathIntegrator& integrator)
+        : integrator(integrator)
+    {
+    }
+
+    // Adds samplesPerPixel samples to each of the pixels (y * width + x) of framebuffer.
+    // Returns the number of rays traced. The job manager must not be running anything else.
+    uint64_t trace(hq::JobManager& jobMgr, const std::vector<uint32_t>& pixels, int samplesPerPixel,
+                   const Camera& camera, const Hitable& world, Framebuffer& framebuffer)
+    {
+        size_t spp       = size_t(std::max(samplesPerPixel, 1));
+        size_t pathCount = pixels.size() * spp;
+        paths.resize(pathCount);
+        hits.resize(pathCount);
+        connections.resize(pathCount);
+        hitFound.resize(pathCount);
+        alive.resize(pathCount);
+        connected.resize(pathCount);
+        firstSamples.resize(pixels.size());
+        rays = 0;
+
+        // generate: camera rays of all samples, path index = pixel slot * spp + sample
+        parallelFor(jobMgr, pixels.size(), parallelChunkCount(pixels.size(), 64),
+                    [&](size_t, size_t begin, size_t end) {
+                        std::unique_ptr<Sampler> sampler = createSampler(samplerType, strataCount, seed);
+                        for (size_t slot = begin; slot < end; ++slot)
+                        {
+                            uint32_t x         = pixels[slot] % framebuffer.width;
+                            uint32_t y         = pixels[slot] / framebuffer.width;
+                            firstSamples[slot] = framebuffer.sampleCount(x, y);
+                            for (size_t s = 0; s < spp; ++s)
+                            {
+                                sampler->startSample(pixels[slot], firstSamples[slot] + uint32_t(s));
+                                paths[slot * spp + s] = integrator.startPath(
+                                    primaryRay(camera, *sampler, x, y, framebuffer.width, framebuffer.height));
+                            }
+                        }
+                    });
+
+        active.resize(pathCount);
+        std::iota(active.begin(), active.end(), 0u);
+        while (!active.empty())
+        {
+            extend(jobMgr, world);
+            sortByMaterial();
+            shade(jobMgr, pixels, spp);
+            traceShadowRays(jobMgr, world);
+
+            // compact: the survivors stay in material order, which the next extend doesn't mind
+            active.clear();
+            for (uint32_t path : sorted)
+            {
+                if (alive[path])
+                    active.push_back(path);
+            }
+        }
+
+        // the samples of a pixel are added in order, as path by path rendering does
+        parallelFor(jobMgr, pixels.size(), parallelChunkCount(pixels.size(), 256),
+                    [&](size_t, size_t begin, size_t end) {
+                        for (size_t slot = begin; slot < end; ++slot)
+                        {
+                            uint32_t x = pixels[slot] % framebuffer.width;
+                            uint32_t y = pixels[slot] / framebuffer.width;
+                            for (size_t s = 0; s < spp; ++s)
+                            {
+                                framebuffer.addSample(x, y, paths[slot * spp + s].radiance);
+                            }
+                        }
+                    });
+        return rays.load();
+    }
+
+public:
+    // sampler settings, as for path by path rendering
+    SamplerType samplerType = SamplerType::Sobol;
+    uint32_t    strataCount = 1;
+    uint64_t    seed        = 0;
+
+private:
+    // closest hit of the ray of every active path
+    void extend(hq::JobManager& jobMgr, const Hitable& world)
+    {
+        parallelFor(jobMgr, active.size(), parallelChunkCount(active.size(), 256),
+                    [&](size_t, size_t begin, size_t end) {
+                        for (size_t i = begin; i < end; ++i)
+                        {
+                            uint32_t path  = active[i];
+                            hitFound[path] = world.hit(paths[path].ray, 0.001f, std::numeric_limits<float>::max(),
+                                                       hits[path]);
+                        }
+                        rays.fetch_add(end - begin, std::memory_order_relaxed);
+#ifdef RAYTRACEY_BVH_STATS
+                        BvhStats::flushLocal();
+#endif
+                    });
+    }
+
+    // Counting sort of the active paths that hit something by the type of the material they
+    // hit, into sorted with materialBegin[type] the start of each bin. Paths that missed end.
+    void sortByMaterial()
+    {
+        const MaterialTable& materials = integrator.materials;
+
+        size_t counts[MaterialTypeCount + 1] = {};
+        for (uint32_t path : active)
+        {
+            if (hitFound[path])
+                ++counts[size_t(materials[hits[path].materialId].type) + 1];
+        }
+        for (size_t type = 0; type < MaterialTypeCount; ++type)
+        {
+            counts[type + 1] += counts[type];
+        }
+        std::copy(counts, counts + MaterialTypeCount + 1, materialBegin);
+
+        sorted.resize(counts[MaterialTypeCount]);
+        for (uint32_t path : active)
+        {
+            if (hitFound[path])
+                sorted[counts[size_t(materials[hits[path].materialId].type)]++] = path;
+        }
+    }
+
+    // emission, light sample and scattering, one material type after the other
+    void shade(hq::JobManager& jobMgr, const std::vector<uint32_t>& pixels, size_t spp)
+    {
+        for (size_t type = 0; type < MaterialTypeCount; ++type)
+        {
+            size_t first = materialBegin[type];
+            size_t count = materialBegin[type + 1] - first;
+            parallelFor(jobMgr, count, parallelChunkCount(count, 256), [&](size_t, size_t begin, size_t end) {
+                std::unique_ptr<Sampler> sampler = createSampler(samplerType, strataCount, seed);
+                for (size_t i = first + begin; i < first + end; ++i)
+                {
+                    uint32_t   path    = sorted[i];
+                    size_t     slot    = path / spp;
+                    PathState& state   = paths[path];
+                    HitData&   hitData = hits[path];
+                    sampler->startSample(pixels[slot], firstSamples[slot] + uint32_t(path % spp));
+
+                    integrator.spreadCone(state, hitData);
+                    integrator.addEmission(state, hitData);
+                    if (state.depth >= integrator.maxDepth)
+                    {
+                        connected[path] = false;
+                        alive[path]     = false;
+                        continue;
+                    }
+                    connected[path] = integrator.connectLight(state, hitData, *sampler, connections[path]);
+                    alive[path]     = integrator.scatter(state, hitData, *sampler);
+                }
+            });
+        }
+    }
+
+    // the rays towards the sampled lights
+    void traceShadowRays(hq::JobManager& jobMgr, const Hitable& world)
+    {
+        parallelFor(jobMgr, sorted.size(), parallelChunkCount(sorted.size(), 256),
+                    [&](size_t, size_t begin, size_t end) {
+                        uint64_t shadowRays = 0;
+                        for (size_t i = begin; i < end; ++i)
+                        {
+                            uint32_t path = sorted[i];
+                            if (!connected[path])
+                                continue;
+
+                            ++shadowRays;
+                            HitData lightHit;
+                            if (world.hit(connections[path].ray, 0.001f, std::numeric_limits<float>::max(),
+                                          lightHit))
+                                integrator.addLight(paths[path], connections[path], lightHit);
+                        }
+                        rays.fetch_add(shadowRays, std::memory_order_relaxed);
+#ifdef RAYTRACEY_BVH_STATS
+                        BvhStats::flushLocal();
+#endif
+                    });
+    }
+
+    const PathIntegrator& integrator;
+
+    // per path state of the current wave
+    std::vector<PathState>       paths;
+    std::vector<HitData>         hits;
+    std::vector<LightConnection> connections;
+    std::vector<uint8_t>         hitFound;
+    std::vector<uint8_t>         alive;
+    std::vector<uint8_t>         connected;
+    std::vector<uint32_t>        firstSamples;  // per pixel, index of the first sample of the wave
+
+    std::vector<uint32_t> active;  // paths with a ray to extend
+    std::vector<uint32_t> sorted;  // active paths with a hit, binned by material type
+    size_t                materialBegin[MaterialTypeCount + 1];
+
+    std::atomic<uint64_t> rays{0};
+};
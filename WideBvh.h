@@ -0,0 +1,414 @@
+#pragma once
+
+#include "AlignedAllocator.h"
+#include "BvhNode.h"
+#include "FlatBvh.h"
+#include "hitable.h"
+#include <assert.h>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <Hq/Math/Utils.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// Node of a BVH with Width children per node, the child boxes are stored as a structure of
+// arrays so a ray is tested against all of them with one sequence of SIMD instructions.
+// Unused slots get an inverted box that never reports a hit.
+template <int Width>
+struct alignas(Width * sizeof(float)) WideBvhNode
+{
+    float    bboxMinX[Width];
+    float    bboxMinY[Width];
+    float    bboxMinZ[Width];
+    float    bboxMaxX[Width];
+    float    bboxMaxY[Width];
+    float    bboxMaxZ[Width];
+    uint32_t child[Width];           // inner child: node index, leaf child: index of the first primitive
+    uint16_t primitiveCount[Width];  // 0 for inner children and empty slots
+
+    void clear()
+    {
+        for (int i = 0; i < Width; ++i)
+        {
+            bboxMinX[i] = bboxMinY[i] = bboxMinZ[i] = std::numeric_limits<float>::infinity();
+            bboxMaxX[i] = bboxMaxY[i] = bboxMaxZ[i] = -std::numeric_limits<float>::infinity();
+            child[i]                                = 0;
+            primitiveCount[i]                       = 0;
+        }
+    }
+
+    void setBbox(int slot, const hq::math::AABBf& bbox)
+    {
+        bboxMinX[slot] = bbox.min().x;
+        bboxMinY[slot] = bbox.min().y;
+        bboxMinZ[slot] = bbox.min().z;
+        bboxMaxX[slot] = bbox.max().x;
+        bboxMaxY[slot] = bbox.max().y;
+        bboxMaxZ[slot] = bbox.max().z;
+    }
+};
+
+// per ray data shared by all box tests of a traversal
+struct WideBvhRay
+{
+    float origin[3];
+    float invDirection[3];
+    bool  negative[3];
+};
+
+// Tests the ray against every child box of node. Returns a bit mask of the hit children and
+// stores the entry distances in tNear. Generic version, left to the auto-vectorizer.
+template <int Width>
+int intersectChildren(const WideBvhNode<Width>& node, const WideBvhRay& ray, float tMin, float tMax, float* tNear)
+{
+    const float* nearX = ray.negative[0] ? node.bboxMaxX : node.bboxMinX;
+    const float* farX  = ray.negative[0] ? node.bboxMinX : node.bboxMaxX;
+    const float* nearY = ray.negative[1] ? node.bboxMaxY : node.bboxMinY;
+    const float* farY  = ray.negative[1] ? node.bboxMinY : node.bboxMaxY;
+    const float* nearZ = ray.negative[2] ? node.bboxMaxZ : node.bboxMinZ;
+    const float* farZ  = ray.negative[2] ? node.bboxMinZ : node.bboxMaxZ;
+
+    int mask = 0;
+    for (int i = 0; i < Width; ++i)
+    {
+        float t0 = std::max(std::max((nearX[i] - ray.origin[0]) * ray.invDirection[0],
+                                     (nearY[i] - ray.origin[1]) * ray.invDirection[1]),
+                            std::max((nearZ[i] - ray.origin[2]) * ray.invDirection[2], tMin));
+        float t1 = std::min(std::min((farX[i] - ray.origin[0]) * ray.invDirection[0],
+                                     (farY[i] - ray.origin[1]) * ray.invDirection[1]),
+                            std::min((farZ[i] - ray.origin[2]) * ray.invDirection[2], tMax));
+        tNear[i] = t0;
+        mask |= (t0 <= t1 ? 1 : 0) << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+template <>
+inline int intersectChildren<4>(const WideBvhNode<4>& node, const WideBvhRay& ray, float tMin, float tMax,
+                                float* tNear)
+{
+    __m128 ox  = _mm_set1_ps(ray.origin[0]);
+    __m128 oy  = _mm_set1_ps(ray.origin[1]);
+    __m128 oz  = _mm_set1_ps(ray.origin[2]);
+    __m128 idx = _mm_set1_ps(ray.invDirection[0]);
+    __m128 idy = _mm_set1_ps(ray.invDirection[1]);
+    __m128 idz = _mm_set1_ps(ray.invDirection[2]);
+
+    __m128 nearX = _mm_load_ps(ray.negative[0] ? node.bboxMaxX : node.bboxMinX);
+    __m128 farX  = _mm_load_ps(ray.negative[0] ? node.bboxMinX : node.bboxMaxX);
+    __m128 nearY = _mm_load_ps(ray.negative[1] ? node.bboxMaxY : node.bboxMinY);
+    __m128 farY  = _mm_load_ps(ray.negative[1] ? node.bboxMinY : node.bboxMaxY);
+    __m128 nearZ = _mm_load_ps(ray.negative[2] ? node.bboxMaxZ : node.bboxMinZ);
+    __m128 farZ  = _mm_load_ps(ray.negative[2] ? node.bboxMinZ : node.bboxMaxZ);
+
+    __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearX, ox), idx), _mm_mul_ps(_mm_sub_ps(nearY, oy), idy)),
+                           _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearZ, oz), idz), _mm_set1_ps(tMin)));
+    __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_mul_ps(_mm_sub_ps(farX, ox), idx), _mm_mul_ps(_mm_sub_ps(farY, oy), idy)),
+                           _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farZ, oz), idz), _mm_set1_ps(tMax)));
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int intersectChildren<8>(const WideBvhNode<8>& node, const WideBvhRay& ray, float tMin, float tMax,
+                                float* tNear)
+{
+    __m256 ox  = _mm256_set1_ps(ray.origin[0]);
+    __m256 oy  = _mm256_set1_ps(ray.origin[1]);
+    __m256 oz  = _mm256_set1_ps(ray.origin[2]);
+    __m256 idx = _mm256_set1_ps(ray.invDirection[0]);
+    __m256 idy = _mm256_set1_ps(ray.invDirection[1]);
+    __m256 idz = _mm256_set1_ps(ray.invDirection[2]);
+
+    __m256 nearX = _mm256_load_ps(ray.negative[0] ? node.bboxMaxX : node.bboxMinX);
+    __m256 farX  = _mm256_load_ps(ray.negative[0] ? node.bboxMinX : node.bboxMaxX);
+    __m256 nearY = _mm256_load_ps(ray.negative[1] ? node.bboxMaxY : node.bboxMinY);
+    __m256 farY  = _mm256_load_ps(ray.negative[1] ? node.bboxMinY : node.bboxMaxY);
+    __m256 nearZ = _mm256_load_ps(ray.negative[2] ? node.bboxMaxZ : node.bboxMinZ);
+    __m256 farZ  = _mm256_load_ps(ray.negative[2] ? node.bboxMinZ : node.bboxMaxZ);
+
+    __m256 t0 = _mm256_max_ps(
+        _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearX, ox), idx), _mm256_mul_ps(_mm256_sub_ps(nearY, oy), idy)),
+        _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearZ, oz), idz), _mm256_set1_ps(tMin)));
+    __m256 t1 = _mm256_min_ps(
+        _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farX, ox), idx), _mm256_mul_ps(_mm256_sub_ps(farY, oy), idy)),
+        _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farZ, oz), idz), _mm256_set1_ps(tMax)));
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// BVH with Width (4 or 8) children per node, collapsed from a binary BvhNode tree.
+template <int Width>
+class WideBvh : public Hitable
+{
+public:
+    static_assert(Width >= 2 && Width <= 16, "WideBvh supports 2 to 16 children per node");
+
+    // collapse() rebalances trees that could overflow it
+    static const int StackSize = 64 * Width;
+
+    WideBvh() {}
+    explicit WideBvh(const BvhNode& root)
+    {
+        collapse(root);
+    }
+
+    void collapse(const BvhNode& root)
+    {
+        nodes.clear();
+        primitives.clear();
+        rootBbox = root.bbox;
+        nodes.emplace_back();
+        nodes.front().clear();
+        depth = 1;
+        if (root.isLeaf())
+            addLeaf(0, 0, root);
+        else
+            depth = collapseNode(0, root);
+
+        // the traversal leaves fewer than Width nodes per level on the stack, deeper trees such
+        // as the SAH builder's chains over clustered primitives would overflow it
+        if (Width * depth > StackSize)
+        {
+            std::cerr << "BVH with " << depth << " levels is too deep to traverse, rebalancing it\n";
+            BvhNode balanced;
+            balanced.buildBalanced(root);
+            collapse(balanced);
+            balanced.release();
+        }
+    }
+
+    // Recomputes all child bounds from the current primitive bounds over [tMin, tMax],
+    // keeping the topology.
+    void refit(float tMin, float tMax)
+    {
+        if (!nodes.empty())
+            rootBbox = refitNode(0, tMin, tMax);
+    }
+
+    bool hit(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const override
+    {
+        uint32_t primitiveIndex = 0;
+        if (!traverse(r, tMin, tMax, primitiveIndex))
+            return false;
+
+        primitives[primitiveIndex]->fillHitData(r, tMax, hitData);
+        return true;
+    }
+
+    bool boundingBox(float /*tMin*/, float /*tMax*/, hq::math::AABBf& bbox) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        bbox = rootBbox;
+        return true;
+    }
+
+    bool traverse(const hq::math::Rayf& r, float tMin, float& tMax, uint32_t& hitIndex) const
+    {
+        if (nodes.empty())
+            return false;
+
+        const hq::math::Vector3f& origin    = r.origin();
+        const hq::math::Vector3f& direction = r.direction();
+        WideBvhRay                ray;
+        ray.origin[0]       = origin.x;
+        ray.origin[1]       = origin.y;
+        ray.origin[2]       = origin.z;
+        ray.invDirection[0] = 1.f / direction.x;
+        ray.invDirection[1] = 1.f / direction.y;
+        ray.invDirection[2] = 1.f / direction.z;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            ray.negative[axis] = ray.invDirection[axis] < 0.f;
+        }
+
+        BVH_STATS_ADD(rays, 1);
+        uint32_t stack[StackSize];
+        int      stackSize   = 0;
+        uint32_t index       = 0;
+        bool     hitAnything = false;
+        for (;;)
+        {
+            BVH_STATS_ADD(nodesVisited, 1);
+            const WideBvhNode<Width>& node = nodes[index];
+            float                     tNear[Width];
+            int                       mask = intersectChildren<Width>(node, ray, tMin, tMax, tNear);
+
+            // leaves are intersected right away, inner children are pushed far to near
+            uint32_t innerChildren[Width];
+            float    innerDistances[Width];
+            int      innerCount = 0;
+            for (int slot = 0; slot < Width; ++slot)
+            {
+                if ((mask & (1 << slot)) == 0)
+                    continue;
+
+                if (node.primitiveCount[slot] > 0)
+                {
+                    uint32_t first = node.child[slot];
+                    for (uint32_t i = first; i < first + node.primitiveCount[slot]; ++i)
+                    {
+                        if (primitives[i]->intersect(r, tMin, tMax, tMax))
+                        {
+                            hitAnything = true;
+                            hitIndex    = i;
+                        }
+                    }
+                    continue;
+                }
+
+                int position = innerCount++;
+                while (position > 0 && innerDistances[position - 1] < tNear[slot])
+                {
+                    innerChildren[position]  = innerChildren[position - 1];
+                    innerDistances[position] = innerDistances[position - 1];
+                    --position;
+                }
+                innerChildren[position]  = node.child[slot];
+                innerDistances[position] = tNear[slot];
+            }
+
+            for (int i = 0; i < innerCount; ++i)
+            {
+                // collapse() keeps the depth within the stack
+                assert(stackSize < StackSize);
+                stack[stackSize++] = innerChildren[i];
+            }
+
+            if (stackSize == 0)
+                break;
+            index = stack[--stackSize];
+        }
+
+        return hitAnything;
+    }
+
+public:
+    std::vector<WideBvhNode<Width>, AlignedAllocator<WideBvhNode<Width>, alignof(WideBvhNode<Width>)> > nodes;
+    std::vector<Hitable*>                                                                          primitives;
+    hq::math::AABBf                                                                                rootBbox;
+    int                                                                                            depth = 1;  // levels
+
+private:
+    void addLeaf(uint32_t nodeIndex, int slot, const BvhNode& leaf)
+    {
+        nodes[nodeIndex].setBbox(slot, leaf.bbox);
+        nodes[nodeIndex].child[slot]          = uint32_t(primitives.size());
+        nodes[nodeIndex].primitiveCount[slot] = uint16_t(leaf.primitives.size());
+        primitives.insert(primitives.end(), leaf.primitives.begin(), leaf.primitives.end());
+    }
+
+    hq::math::AABBf refitNode(uint32_t nodeIndex, float tMin, float tMax)
+    {
+        hq::math::AABBf nodeBbox;
+        bool            empty = true;
+        for (int slot = 0; slot < Width; ++slot)
+        {
+            uint32_t        child = nodes[nodeIndex].child[slot];
+            uint16_t        count = nodes[nodeIndex].primitiveCount[slot];
+            hq::math::AABBf bbox;
+            if (count > 0)
+            {
+                for (uint32_t i = child; i < child + count; ++i)
+                {
+                    hq::math::AABBf primitiveBbox;
+                    if (!primitives[i]->boundingBox(tMin, tMax, primitiveBbox))
+                    {
+                        std::cerr << "No bounding box in WideBvh::refit\n";
+                    }
+                    bbox = i == child ? primitiveBbox : surroundingBbox(bbox, primitiveBbox);
+                }
+            }
+            else if (child != 0)  // the root is nobody's child, so 0 marks an empty slot
+            {
+                bbox = refitNode(child, tMin, tMax);
+            }
+            else
+            {
+                continue;
+            }
+
+            nodes[nodeIndex].setBbox(slot, bbox);
+            nodeBbox = empty ? bbox : surroundingBbox(nodeBbox, bbox);
+            empty    = false;
+        }
+        return nodeBbox;
+    }
+
+    // returns the number of levels of the collapsed subtree
+    int collapseNode(uint32_t nodeIndex, const BvhNode& node)
+    {
+        // open up the largest inner child until the node is full
+        const BvhNode* children[Width];
+        int            childCount = 2;
+        children[0]               = node.left;
+        children[1]               = node.right;
+        while (childCount < Width)
+        {
+            int   largest     = -1;
+            float largestArea = -1.f;
+            for (int i = 0; i < childCount; ++i)
+            {
+                float area = bboxSurfaceArea(children[i]->bbox);
+                if (!children[i]->isLeaf() && area > largestArea)
+                {
+                    largest     = i;
+                    largestArea = area;
+                }
+            }
+            if (largest < 0)
+                break;
+
+            const BvhNode* opened  = children[largest];
+            children[largest]      = opened->left;
+            children[childCount++] = opened->right;
+        }
+
+        int levels = 1;
+        for (int slot = 0; slot < childCount; ++slot)
+        {
+            const BvhNode& child = *children[slot];
+            if (child.isLeaf())
+            {
+                addLeaf(nodeIndex, slot, child);
+                continue;
+            }
+
+            uint32_t childIndex = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[childIndex].clear();
+            nodes[nodeIndex].setBbox(slot, child.bbox);
+            nodes[nodeIndex].child[slot] = childIndex;
+            levels                       = std::max(levels, 1 + collapseNode(childIndex, child));
+        }
+        return levels;
+    }
+};
+
+// Runtime selection of the BVH width: 2 gives the binary FlatBvh, 4 and 8 the collapsed wide
+// variants. Returns nullptr for unsupported widths.
+std::unique_ptr<Hitable> createBvh(const BvhNode& root, int width)
+{
+    switch (width)
+    {
+        case 2:
+            return std::unique_ptr<Hitable>(new FlatBvh(root));
+        case 4:
+            return std::unique_ptr<Hitable>(new WideBvh<4>(root));
+        case 8:
+            return std::unique_ptr<Hitable>(new WideBvh<8>(root));
+        default:
+            std::cerr << "Unsupported BVH width " << width << "\n";
+            return nullptr;
+    }
+}
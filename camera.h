@@ -1,9 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <Hq/Math/Ray.h>
 #include <Hq/Math/Utils.h>
 #include <Hq/Math/Vector.h>
 #include <Hq/Rng.h>
+#include "Sampling.h"
 
 class Camera
 {
@@ -26,13 +28,21 @@ public:
         lowerLeft        = origin - halfWidth * focusDistance * u - halfHeight * focusDistance * v - focusDistance * w;
         horizontal       = 2 * halfWidth * focusDistance * u;
         vertical         = 2 * halfHeight * focusDistance * v;
+        planeHeight      = 2 * halfHeight;
     }
 
-    hq::math::Rayf getRay(float s, float t)
+    // angle between the rays through neighbouring pixels of an image height pixels high
+    float pixelSpread(uint32_t height) const
     {
-        hq::math::Vector3f rd     = lensRadius * hq::math::RandomInUnitDisk();
+        return planeHeight / float(height);
+    }
+
+    // lensSample and timeSample are uniform in [0, 1)
+    hq::math::Rayf getRay(float s, float t, const hq::math::Vector2f& lensSample, float timeSample) const
+    {
+        hq::math::Vector3f rd     = lensRadius * concentricDisk(lensSample);
         hq::math::Vector3f offset = u * rd.x + v * rd.y;
-        float              time   = timeStart + hq::rand01() * (timeStart - timeEnd);
+        float              time   = timeStart + timeSample * (timeStart - timeEnd);
         return hq::math::Rayf(origin + offset, lowerLeft + s * horizontal + t * vertical - origin - offset, time);
     }
 
@@ -43,6 +53,7 @@ public:
     hq::math::Vector3f vertical;
     hq::math::Vector3f u, v, w;
     float              lensRadius;
+    float              planeHeight;  // height of the image plane at distance 1
     float              timeStart;
     float              timeEnd;
 };
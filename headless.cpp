@@ -0,0 +1,137 @@
+#include "HitableList.h"
+#include "ImageWriter.h"
+#include "Renderer.h"
+#include "Scenes.h"
+#include <Hq/JobManager.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+using namespace hq;
+using namespace hq::math;
+
+// Renders the textured scene without a window and writes it to disk, for machines with no
+// display. Usage: raytracey_headless [options] [output] [samples per pixel] [more outputs...]
+// The format follows the extension: .ppm, .png or .pfm for the linear HDR values. Options:
+//   --wavefront       render with the wavefront integrator instead of path by path
+//   --no-sphere-soa   trace a wide BVH of Sphere objects instead of the SIMD sphere batches
+//   --bvh-width N     children per node of that BVH: 2, 4 or 8, implies --no-sphere-soa
+//   --linear-bvh      build the BVH with Morton codes, faster to build but slower to trace
+int main(int argc, char** argv)
+{
+    using namespace std::chrono;
+
+    RenderSettings           settings;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--wavefront")
+        {
+            settings.wavefront = true;
+        }
+        else if (arg == "--linear-bvh")
+        {
+            settings.linearBvh = true;
+        }
+        else if (arg == "--no-sphere-soa")
+        {
+            settings.sphereSoA = false;
+        }
+        else if (arg == "--bvh-width")
+        {
+            if (i + 1 == argc)
+            {
+                std::cerr << "--bvh-width needs the number of children per node\n";
+                return -1;
+            }
+            settings.bvhWidth  = std::atoi(argv[++i]);
+            settings.sphereSoA = false;
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            std::cerr << "Unknown option " << arg << "\n";
+            return -1;
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    std::vector<std::string> outputPaths = {args.size() > 0 ? args[0] : "raytracey.ppm"};
+    for (size_t i = 2; i < args.size(); ++i)
+    {
+        outputPaths.push_back(args[i]);
+    }
+    if (args.size() > 1)
+        settings.samples = std::max(std::atoi(args[1].c_str()), 1);
+
+    high_resolution_clock::time_point wallStart = high_resolution_clock::now();
+    JobManager                        jobMgr;
+    jobMgr.init();
+    jobMgr.wait();
+
+    Camera        cam = createTexturedSceneCamera(float(settings.width) / float(settings.height));
+    HitableList   world;
+    MaterialTable materials;
+    std::vector<StbImage> resources = createTexturedScene(world, materials);
+    // the lights are numbered on the spheres before the BVH copies them
+    std::vector<SphereLight> lights;
+    if (settings.lightSampling)
+        lights = collectSphereLights(world.list, materials);
+    std::unique_ptr<Hitable> bvh = buildBvh(world.list, settings, jobMgr);
+    if (bvh == nullptr)
+    {
+        jobMgr.release();
+        return -1;
+    }
+
+    Renderer renderer(settings, cam, *bvh, materials);
+    renderer.integrator.lights = lights;
+    renderer.render(jobMgr);
+    jobMgr.release();
+
+    // all formats are encoded at the same time, from one copy of the image
+    std::shared_ptr<const Image>    image = std::make_shared<const Image>(renderer.framebuffer);
+    std::vector<std::future<bool> > writes;
+    for (const std::string& path : outputPaths)
+    {
+        writes.push_back(writeImageAsync(path, image));
+    }
+    duration<double> wallTime      = duration_cast<duration<double> >(high_resolution_clock::now() - wallStart);
+    double           raysPerSecond = double(renderer.totalRays) / std::max(renderer.renderTime.count(), 1e-9);
+    std::cout << "Rendered " << renderer.averageSamplesPerPixel() << " samples per pixel in "
+              << renderer.renderTime.count() << " s, " << raysPerSecond * 1e-6 << " Mrays/s, "
+              << double(renderer.totalRays) / double(std::max<uint64_t>(renderer.totalPaths, 1)) << " rays per path\n";
+#ifdef RAYTRACEY_BVH_STATS
+    uint64_t rays = BvhStats::totalRays().load();
+    std::cout << "BVH nodes visited per ray: "
+              << double(BvhStats::totalNodesVisited().load()) / double(rays > 0 ? rays : 1) << "\n";
+#endif
+    std::cout << "Wall time " << wallTime.count() << " s\n";
+
+    for (auto* hitable : world.list)
+    {
+        delete hitable;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < writes.size(); ++i)
+    {
+        if (writes[i].get())
+            std::cout << "Wrote " << outputPaths[i] << "\n";
+        else
+            result = -1;
+    }
+    return result;
+}
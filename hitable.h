@@ -1,17 +1,27 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <Hq/Math/AABB.h>
 #include <Hq/Math/Ray.h>
 
-class Material;
+// index of a material in the MaterialTable of the scene
+using MaterialId = uint32_t;
+
+// light index of primitives that aren't sampled as lights
+const uint32_t NoLight = std::numeric_limits<uint32_t>::max();
 
 struct HitData
 {
     float              t;
     hq::math::Vector3f p;
     hq::math::Vector3f normal;
-    Material*          materialPtr;
+    MaterialId         materialId;
+    uint32_t           light;  // index of the hit primitive in the integrator's lights, or NoLight
     hq::math::Vector2f uv;
+    float              uvScale;          // surface length per unit of uv around p
+    float              footprint = 0.f;  // width of the ray footprint in uv units, set by the integrator
 };
 
 class Hitable
@@ -21,4 +31,22 @@ public:
 
     virtual bool hit(const hq::math::Rayf& r, float tMin, float tMax, HitData& hitData) const = 0;
     virtual bool boundingBox(float tMin, float tMax, hq::math::AABBf& bbox) const             = 0;
+
+    // Finds only the distance to the closest hit, traversal kernels use it to defer the
+    // shading work of hit() until the final hit is known. Primitives should override it.
+    virtual bool intersect(const hq::math::Rayf& r, float tMin, float tMax, float& t) const
+    {
+        HitData hitData;
+        if (!hit(r, tMin, tMax, hitData))
+            return false;
+
+        t = hitData.t;
+        return true;
+    }
+
+    // Completes hitData for a hit at distance t previously reported by intersect().
+    virtual void fillHitData(const hq::math::Rayf& r, float t, HitData& hitData) const
+    {
+        hit(r, std::nextafter(t, 0.f), std::nextafter(t, std::numeric_limits<float>::max()), hitData);
+    }
 };
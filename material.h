@@ -1,157 +1,221 @@
 #pragma once
 
+#include "Sampler.h"
+#include "Sampling.h"
 #include "hitable.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 #include <Hq/Math/Utils.h>
-#include <Hq/Rng.h>
 #include "Texture.h"
 
-class Material
+enum class MaterialType : uint32_t
 {
-public:
-    virtual ~Material() {}
-    virtual bool scatter(const hq::math::Rayf& rayIn, const HitData& hitData, hq::math::Vector3f& attenuation,
-                         hq::math::Rayf& scattered) const = 0;
-    virtual hq::math::Vector3f emitted(float u, float v, const hq::math::Vector3f& p)
-    {
-        (void)u;
-        (void)v;
-        (void)p;
-        return hq::math::Vector3f();
-    }
+    Lambertian,
+    Metal,
+    Dielectric,
+    DiffuseLight
 };
 
-class Lambertian : public Material
+const size_t MaterialTypeCount = 4;
+
+// Parameters of any of the materials, each type only uses its own
+struct Material
 {
-public:
-    Lambertian(TexturePtr albedo)
-        : albedo(albedo)
+    MaterialType       type      = MaterialType::Lambertian;
+    TexturePtr         texture   = nullptr;  // albedo of Lambertian, emission of DiffuseLight
+    hq::math::Vector3f albedo    = hq::math::Vector3f(0.f, 0.f, 0.f);  // Metal
+    float              roughness = 0.f;                                // Metal, in [0, 1]
+    float              refIdx    = 1.f;                                // Dielectric
+};
+
+Material makeLambertian(TexturePtr albedo)
+{
+    Material material;
+    material.type    = MaterialType::Lambertian;
+    material.texture = albedo;
+    return material;
+}
+
+Material makeMetal(const hq::math::Vector3f& albedo, float roughness = 0.f)
+{
+    Material material;
+    material.type      = MaterialType::Metal;
+    material.albedo    = albedo;
+    material.roughness = roughness < 1.f ? roughness : 1.f;
+    return material;
+}
+
+Material makeDielectric(float refIdx)
+{
+    Material material;
+    material.type   = MaterialType::Dielectric;
+    material.refIdx = refIdx;
+    return material;
+}
+
+Material makeDiffuseLight(TexturePtr emitter)
+{
+    Material material;
+    material.type    = MaterialType::DiffuseLight;
+    material.texture = emitter;
+    return material;
+}
+
+bool scatterLambertian(const Material& material, const hq::math::Rayf& rayIn, const HitData& hitData,
+                       hq::math::Vector3f& attenuation, hq::math::Rayf& scattered, Sampler& sampler)
+{
+    using namespace hq::math;
+    // cosine distributed around the normal, as lambertianPdf() expects
+    Vector3f direction = Onb(hitData.normal).toWorld(cosineHemisphere(sampler.get2D()));
+    scattered          = Rayf(hitData.p, direction, rayIn.time());
+    attenuation        = material.texture->value(hitData.uv.u, hitData.uv.v, hitData.p, hitData.footprint);
+    return true;
+}
+
+float lambertianPdf(const HitData& hitData, const hq::math::Vector3f& direction)
+{
+    float cosine = dot(hitData.normal, normalize(direction));
+    return cosine > 0.f ? cosine / float(M_PI) : 0.f;
+}
+
+bool scatterMetal(const Material& material, const hq::math::Rayf& rayIn, const HitData& hitData,
+                  hq::math::Vector3f& attenuation, hq::math::Rayf& scattered, Sampler& sampler)
+{
+    using namespace hq::math;
+    Vector3f reflected     = reflect(rayIn.direction(), hitData.normal);
+    Vector2f fuzzDirection = sampler.get2D();
+    float    fuzzRadius    = sampler.get1D();
+    scattered              = Rayf(hitData.p, reflected + material.roughness * uniformBall(fuzzDirection, fuzzRadius));
+    attenuation            = material.albedo;
+    return (dot(scattered.direction(), hitData.normal) > 0.f);
+}
+
+float schlick(float cosine, float refIdx)
+{
+    float r0 = (1.f - refIdx) / (1 + refIdx);
+    r0       = r0 * r0;
+    return r0 + (1 - r0) * std::pow((1.f - cosine), 5.f);
+}
+
+bool scatterDielectric(const Material& material, const hq::math::Rayf& rayIn, const HitData& hitData,
+                       hq::math::Vector3f& attenuation, hq::math::Rayf& scattered, Sampler& sampler)
+{
+    using namespace hq::math;
+    float    refIdx = material.refIdx;
+    Vector3f outwardNormal;
+    Vector3f reflected = reflect(rayIn.direction(), hitData.normal);
+    float    niOverNt;
+    attenuation = Vector3f(1.f, 1.f, 1.f);
+    Vector3f refracted;
+    float    reflectProb;
+    float    cosine;
+    if (dot(rayIn.direction(), hitData.normal) > 0.f)
     {
+        outwardNormal = -hitData.normal;
+        niOverNt      = refIdx;
+        cosine        = refIdx * dot(rayIn.direction(), hitData.normal);
     }
-
-    bool scatter(const hq::math::Rayf& rayIn, const HitData& hitData, hq::math::Vector3f& attenuation,
-                 hq::math::Rayf& scattered) const override
+    else
+    {
+        outwardNormal = hitData.normal;
+        niOverNt      = 1.f / refIdx;
+        cosine        = -dot(rayIn.direction(), hitData.normal);
+    }
+    if (refract(rayIn.direction(), outwardNormal, niOverNt, refracted))
+    {
+        reflectProb = schlick(cosine, refIdx);
+    }
+    else
+    {
+        scattered   = Rayf(hitData.p, reflected);
+        reflectProb = 1.f;
+    }
+    if (sampler.get1D() < reflectProb)
+    {
+        scattered = Rayf(hitData.p, reflected);
+    }
+    else
     {
-        using namespace hq::math;
-        Vector3f target = hitData.p + hitData.normal + RandomInUnitSphere();
-        scattered       = Rayf(hitData.p, target - hitData.p, rayIn.time());
-        attenuation     = albedo->value(hitData.uv.u, hitData.uv.v, hitData.p);
-        return true;
+        scattered = Rayf(hitData.p, refracted);
     }
 
-    TexturePtr albedo {nullptr};
-};
+    return true;
+}
 
-class Metal : public Material
+// All materials of a scene in one flat array, referenced by MaterialId from the primitives and
+// HitData. The shading functions switch over the closed set of material types instead of
+// calling virtual functions, so the compiler sees all of them and can inline them.
+class MaterialTable
 {
 public:
-    Metal(const hq::math::Vector3f& albedo, float roughness = 0.f)
-        : albedo(albedo)
+    MaterialId add(const Material& material)
     {
-        if (roughness < 1.f)
-            this->roughness = roughness;
-        else
-            this->roughness = 1.f;
+        materials.push_back(material);
+        return MaterialId(materials.size() - 1);
     }
 
-    bool scatter(const hq::math::Rayf& rayIn, const HitData& hitData, hq::math::Vector3f& attenuation,
-                 hq::math::Rayf& scattered) const override
+    const Material& operator[](MaterialId id) const
     {
-        using namespace hq::math;
-        Vector3f reflected = reflect(rayIn.direction(), hitData.normal);
-        scattered          = Rayf(hitData.p, reflected + roughness * RandomInUnitSphere());
-        attenuation        = albedo;
-        return (dot(scattered.direction(), hitData.normal) > 0.f);
+        return materials[id];
     }
 
-    hq::math::Vector3f albedo;
-    float              roughness;
-};
-
-class Dielectric : public Material
-{
-public:
-    Dielectric(float refIdx)
-        : refIdx(refIdx)
+    size_t size() const
     {
+        return materials.size();
     }
 
-    bool scatter(const hq::math::Rayf& rayIn, const HitData& hitData, hq::math::Vector3f& attenuation,
-                 hq::math::Rayf& scattered) const override
+    bool scatter(MaterialId id, const hq::math::Rayf& rayIn, const HitData& hitData, hq::math::Vector3f& attenuation,
+                 hq::math::Rayf& scattered, Sampler& sampler) const
     {
-        using namespace hq::math;
-        Vector3f outwardNormal;
-        Vector3f reflected = reflect(rayIn.direction(), hitData.normal);
-        float    niOverNt;
-        attenuation = Vector3f(1.f, 1.f, 1.f);
-        Vector3f refracted;
-        float    reflectProb;
-        float    cosine;
-        if (dot(rayIn.direction(), hitData.normal) > 0.f)
-        {
-            outwardNormal = -hitData.normal;
-            niOverNt      = refIdx;
-            cosine        = refIdx * dot(rayIn.direction(), hitData.normal);
-        }
-        else
-        {
-            outwardNormal = hitData.normal;
-            niOverNt      = 1.f / refIdx;
-            cosine        = -dot(rayIn.direction(), hitData.normal);
-        }
-        if (refract(rayIn.direction(), outwardNormal, niOverNt, refracted))
-        {
-            reflectProb = schlick(cosine, refIdx);
-        }
-        else
-        {
-            scattered   = Rayf(hitData.p, reflected);
-            reflectProb = 1.f;
-        }
-        if (hq::rand01() < reflectProb)
+        const Material& material = materials[id];
+        switch (material.type)
         {
-            scattered = Rayf(hitData.p, reflected);
+            case MaterialType::Lambertian:
+                return scatterLambertian(material, rayIn, hitData, attenuation, scattered, sampler);
+            case MaterialType::Metal:
+                return scatterMetal(material, rayIn, hitData, attenuation, scattered, sampler);
+            case MaterialType::Dielectric:
+                return scatterDielectric(material, rayIn, hitData, attenuation, scattered, sampler);
+            case MaterialType::DiffuseLight:
+                return false;
         }
-        else
-        {
-            scattered = Rayf(hitData.p, refracted);
-        }
-
-        return true;
+        return false;
     }
 
-    float schlick(float cosine, float refIdx) const
+    hq::math::Vector3f emitted(MaterialId id, float u, float v, const hq::math::Vector3f& p, float footprint) const
     {
-        float r0 = (1.f - refIdx) / (1 + refIdx);
-        r0       = r0 * r0;
-        return r0 + (1 - r0) * std::pow((1.f - cosine), 5.f);
+        const Material& material = materials[id];
+        if (material.type == MaterialType::DiffuseLight)
+            return material.texture->value(u, v, p, footprint);
+        return hq::math::Vector3f(0.f, 0.f, 0.f);
     }
 
-    float refIdx;
-};
-
-class DiffuseLight : public Material
-{
-public:
-    DiffuseLight(TexturePtr albedo)
-        : emitter(albedo)
+    // Specular materials scatter into a single (or a fuzzed single) direction they can't give
+    // a density for, so light sampling skips them.
+    bool isSpecular(MaterialId id) const
     {
+        return materials[id].type != MaterialType::Lambertian;
     }
 
-    // Material interface
-    bool scatter(const hq::math::Rayf& rayIn, const HitData& hitData, hq::math::Vector3f& attenuation,
-                 hq::math::Rayf& scattered) const override
+    // BSDF times the cosine to the normal for scattering into direction, non-specular only
+    hq::math::Vector3f evaluate(MaterialId id, const HitData& hitData, const hq::math::Vector3f& direction) const
     {
-        (void)rayIn;
-        (void)hitData;
-        (void)attenuation;
-        (void)scattered;
-        return false;
+        const Material& material = materials[id];
+        if (material.type != MaterialType::Lambertian)
+            return hq::math::Vector3f(0.f, 0.f, 0.f);
+        return material.texture->value(hitData.uv.u, hitData.uv.v, hitData.p, hitData.footprint) *
+               lambertianPdf(hitData, direction);
     }
 
-    hq::math::Vector3f emitted(float u, float v, const hq::math::Vector3f& p) override
+    // solid angle density of scatter() picking direction, non-specular only
+    float pdf(MaterialId id, const HitData& hitData, const hq::math::Vector3f& direction) const
     {
-        return emitter->value(u, v, p);
+        if (materials[id].type != MaterialType::Lambertian)
+            return 0.f;
+        return lambertianPdf(hitData, direction);
     }
 
-    TexturePtr emitter;
+public:
+    std::vector<Material> materials;
 };
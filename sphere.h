@@ -1,7 +1,8 @@
 #pragma once
 
 #include "hitable.h"
-#include <memory>
+#include <algorithm>
+#include <cmath>
 #include <Hq/Math/Utils.h>
 #include <Hq/Utils.h>
 
@@ -13,16 +14,24 @@ void GetSphereUV(const hq::math::Vector3f& p, float& u, float& v)
     v           = (theta + M_PI / 2) / M_PI;
 }
 
+// Surface length per unit of uv on a sphere at normal, the square root of the area of a uv unit:
+// a unit of u spans 2 pi r cos(latitude), a unit of v pi r. Hollow spheres have a negative radius.
+float sphereUvScale(const hq::math::Vector3f& normal, float radius)
+{
+    float cosLatitude = std::sqrt(std::max(1.f - normal.y * normal.y, 0.f));
+    return float(M_PI) * std::fabs(radius) * std::sqrt(2.f * cosLatitude);
+}
+
 class Sphere : public Hitable
 {
 public:
     Sphere() {}
     ~Sphere() override {}
-    Sphere(hq::math::Vector3f center, float radius, std::unique_ptr<Material> material,
+    Sphere(hq::math::Vector3f center, float radius, MaterialId material,
            hq::math::Vector3f velocity = hq::math::Vector3f(0.f, 0.f, 0.f))
         : center(center)
         , radius(radius)
-        , material(std::move(material))
+        , material(material)
         , velocity(velocity)
     {
     }
@@ -36,22 +45,27 @@ public:
         float    discriminant = b * b - a * c;
         if (discriminant > 0.f)
         {
-            hitData.materialPtr = material.get();
-            float temp          = (-b - sqrt(b * b - a * c)) / a;
+            float temp = (-b - sqrt(b * b - a * c)) / a;
             if (temp < tMax && temp > tMin)
             {
-                hitData.t      = temp;
-                hitData.p      = r.pointOnRay(temp);
-                hitData.normal = (hitData.p - getCenter(r.time())) / radius;
+                hitData.t          = temp;
+                hitData.p          = r.pointOnRay(temp);
+                hitData.normal     = (hitData.p - getCenter(r.time())) / radius;
+                hitData.materialId = material;
+                hitData.light      = light;
+                hitData.uvScale    = sphereUvScale(hitData.normal, radius);
                 GetSphereUV(hitData.normal, hitData.uv.u, hitData.uv.v);
                 return true;
             }
             temp = (-b + sqrt(b * b - a * c)) / a;
             if (temp < tMax && temp > tMin)
             {
-                hitData.t      = temp;
-                hitData.p      = r.pointOnRay(temp);
-                hitData.normal = (hitData.p - getCenter(r.time())) / radius;
+                hitData.t          = temp;
+                hitData.p          = r.pointOnRay(temp);
+                hitData.normal     = (hitData.p - getCenter(r.time())) / radius;
+                hitData.materialId = material;
+                hitData.light      = light;
+                hitData.uvScale    = sphereUvScale(hitData.normal, radius);
                 GetSphereUV(hitData.normal, hitData.uv.u, hitData.uv.v);
                 return true;
             }
@@ -60,6 +74,44 @@ public:
         return false;
     }
 
+    bool intersect(const hq::math::Rayf& r, float tMin, float tMax, float& t) const override
+    {
+        using namespace hq::math;
+        Vector3f oc           = r.origin() - getCenter(r.time());
+        float    a            = dot(r.direction(), r.direction());
+        float    b            = dot(oc, r.direction());
+        float    c            = dot(oc, oc) - radius * radius;
+        float    discriminant = b * b - a * c;
+        if (discriminant > 0.f)
+        {
+            float temp = (-b - sqrt(discriminant)) / a;
+            if (temp < tMax && temp > tMin)
+            {
+                t = temp;
+                return true;
+            }
+            temp = (-b + sqrt(discriminant)) / a;
+            if (temp < tMax && temp > tMin)
+            {
+                t = temp;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void fillHitData(const hq::math::Rayf& r, float t, HitData& hitData) const override
+    {
+        hitData.t          = t;
+        hitData.p          = r.pointOnRay(t);
+        hitData.normal     = (hitData.p - getCenter(r.time())) / radius;
+        hitData.materialId = material;
+        hitData.light      = light;
+        hitData.uvScale    = sphereUvScale(hitData.normal, radius);
+        GetSphereUV(hitData.normal, hitData.uv.u, hitData.uv.v);
+    }
+
     bool boundingBox(float tMin, float tMax, hq::math::AABBf& bbox) const override
     {
         using namespace hq::math;
@@ -83,8 +135,9 @@ public:
     }
 
 public:
-    hq::math::Vector3f        center;
-    float                     radius;
-    std::unique_ptr<Material> material;
-    hq::math::Vector3f        velocity;
+    hq::math::Vector3f center;
+    float              radius;
+    MaterialId         material = 0;
+    uint32_t           light    = NoLight;  // set by collectSphereLights()
+    hq::math::Vector3f velocity;
 };